@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Latency of reading the pg_stat_monitor views with many entries.
+#
+# Fills the current bucket with distinct statements, then reads each view
+# repeatedly with pgbench and prints the average latency.  The bucket only
+# holds pg_stat_monitor.max / pg_stat_monitor.pgsm_max_buckets entries, so
+# size pg_stat_monitor.max (and pgsm_query_shared_buffer) for the number of
+# entries wanted before starting the server, and pgsm_agg_max_database,
+# pgsm_agg_max_user and pgsm_agg_max_host for the aggregate views.  The
+# connection is taken from the usual PG* environment variables.
+#
+# Usage: bench/scrape.sh [entries] [seconds]
+
+ENTRIES=${1:-50000}
+DURATION=${2:-30}
+
+set -e
+
+psql -X -q -c "CREATE EXTENSION IF NOT EXISTS pg_stat_monitor"
+psql -X -q -c "SELECT pg_stat_monitor_reset()" >/dev/null
+
+# Distinct statements with texts of a realistic length
+psql -X -q <<SQL
+SET pg_stat_monitor.track = 'all';
+DO \$\$
+DECLARE
+	i int;
+BEGIN
+	FOR i IN 1..$ENTRIES LOOP
+		EXECUTE format('SELECT %s AS %I, relname, relkind FROM pg_class WHERE relname = %L AND relnamespace > %s ORDER BY relname',
+					   i, 'c' || i, 'r' || i, i);
+	END LOOP;
+END
+\$\$;
+SQL
+
+psql -X -A -t -c "SELECT count(*) || ' entries' FROM pg_stat_monitor"
+
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+scrape()
+{
+	echo "$2" > "$SCRIPT"
+	latency=$(pgbench -n -f "$SCRIPT" -T "$DURATION" -c 1 |
+			  sed -n 's/^latency average = \([0-9.]*\).*/\1/p')
+	printf '%-28s %12s ms\n' "$1" "$latency"
+}
+
+scrape "pg_stat_monitor(true)" "SELECT sum(length(query)) FROM pg_stat_monitor(true);"
+scrape pg_stat_monitor "SELECT sum(length(query)) FROM pg_stat_monitor;"
+scrape pg_stat_monitor_stats "SELECT sum(calls) FROM pg_stat_monitor_stats;"
+scrape pg_stat_agg_database "SELECT sum(total_calls) FROM pg_stat_agg_database;"
+scrape pg_stat_agg_user "SELECT sum(total_calls) FROM pg_stat_agg_user;"
+scrape pg_stat_agg_ip "SELECT sum(total_calls) FROM pg_stat_agg_ip;"
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Overhead of the pg_stat_monitor.pgsm_timing modes under pgbench -S.
+#
+# Runs the select-only pgbench workload with pg_stat_monitor tracking
+# nothing, then with each timing mode, and prints the tps of each run.
+# Needs a server with pg_stat_monitor in shared_preload_libraries; the
+# connection is taken from the usual PG* environment variables.
+#
+# Usage: bench/timing.sh [seconds] [clients]
+
+DURATION=${1:-60}
+CLIENTS=${2:-8}
+
+set -e
+
+psql -X -q -c "CREATE EXTENSION IF NOT EXISTS pg_stat_monitor"
+pgbench -q -i -s 10 >/dev/null 2>&1
+
+run()
+{
+	psql -X -q -c "ALTER SYSTEM SET pg_stat_monitor.track = '$1'" \
+		 -c "ALTER SYSTEM SET pg_stat_monitor.pgsm_timing = '$2'" \
+		 -c "SELECT pg_reload_conf()" >/dev/null
+	psql -X -q -c "SELECT pg_stat_monitor_reset()" >/dev/null
+	tps=$(pgbench -n -S -M prepared -T "$DURATION" -c "$CLIENTS" -j "$CLIENTS" |
+		  sed -n 's/^tps = \([0-9.]*\).*/\1/p' | head -1)
+	printf '%-6s %-6s %12s tps\n' "$1" "$2" "$tps"
+}
+
+run none full
+run top full
+run top fast
+
+psql -X -q -c "ALTER SYSTEM RESET pg_stat_monitor.track" \
+	 -c "ALTER SYSTEM RESET pg_stat_monitor.pgsm_timing" \
+	 -c "SELECT pg_reload_conf()" >/dev/null
@@ -12,6 +12,26 @@
 #include "postgres.h"
 
 #include "pg_stat_monitor.h"
+
+#include "utils/varlena.h"
+
+char *pgsm_agg_dimensions_string = NULL;
+int pgsm_agg_dimensions = (1 << AGG_KEY_DATABASE) | (1 << AGG_KEY_USER) | (1 << AGG_KEY_HOST);
+char *pgsm_tag = NULL;
+
+/* Names of the aggregate dimensions, in AGG_KEY order */
+const char *agg_dimension_names[AGG_KEY_COUNT] =
+{
+	"database",
+	"user",
+	"host",
+	"application_name",
+	"tag",
+	"client_port"
+};
+
+static bool check_agg_dimensions(char **newval, void **extra, GucSource source);
+static void assign_agg_dimensions(const char *newval, void *extra);
  
 /*
  * Define (or redefine) custom GUC variables.
@@ -67,7 +87,7 @@ init_guc(void)
 		.guc_desc = "Sets the maximum number of buckets.",
 		.guc_default = 10,
 		.guc_min = 1,
-		.guc_max = 10,
+		.guc_max = MAX_BUCKETS,
 		.guc_restart = true
 	};
 	conf[i++] = (GucVariable) { 
@@ -113,7 +133,11 @@ init_guc(void)
 		.guc_max = INT_MAX,
 		.guc_restart = true
 	};
-#if PG_VERSION_NUM >= 130000
+	/*
+	 * Described on every version, like the variable itself, so the conf[]
+	 * indexes of the settings after it do not depend on the server version.
+	 * Before 13 it has no effect.
+	 */
 	conf[i++] = (GucVariable) { 
 		.guc_name = "pg_stat_monitor.pgsm_track_planning",
 		.guc_desc = "Selects whether planning statistics are tracked.",
@@ -122,7 +146,141 @@ init_guc(void)
 		.guc_max = 0,
 		.guc_restart = false
 	};
-#endif	
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_timing",
+		.guc_desc = "Selects how statement execution time is measured.",
+		.guc_default = 0,
+		.guc_min = 0,
+		.guc_max = 0,
+		.guc_restart = false
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_sample_rate",
+		.guc_desc = "Sets the percentage of statement executions that are tracked.",
+		.guc_default = 100,
+		.guc_min = 1,
+		.guc_max = 100,
+		.guc_restart = false
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_sample_slow_threshold",
+		.guc_desc = "Sets the execution time in millisecond above which statements are tracked regardless of sampling.",
+		.guc_default = 0,
+		.guc_min = 0,
+		.guc_max = INT_MAX,
+		.guc_restart = false
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_topk",
+		.guc_desc = "Selects which queries are kept when a bucket is full.",
+		.guc_default = 0,
+		.guc_min = 0,
+		.guc_max = 0,
+		.guc_restart = false
+	};
+	
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_max_database",
+		.guc_desc = "Sets the maximum number of per-database aggregates.",
+		.guc_default = 5000,
+		.guc_min = 100,
+		.guc_max = INT_MAX,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_max_user",
+		.guc_desc = "Sets the maximum number of per-user aggregates.",
+		.guc_default = 5000,
+		.guc_min = 100,
+		.guc_max = INT_MAX,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_max_host",
+		.guc_desc = "Sets the maximum number of per-host aggregates.",
+		.guc_default = 5000,
+		.guc_min = 100,
+		.guc_max = INT_MAX,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_max_application_name",
+		.guc_desc = "Sets the maximum number of per-application aggregates.",
+		.guc_default = 1000,
+		.guc_min = 100,
+		.guc_max = INT_MAX,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_max_tag",
+		.guc_desc = "Sets the maximum number of per-tag aggregates.",
+		.guc_default = 1000,
+		.guc_min = 100,
+		.guc_max = INT_MAX,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_max_client_port",
+		.guc_desc = "Sets the maximum number of per-client-port-range aggregates.",
+		.guc_default = 1000,
+		.guc_min = 100,
+		.guc_max = INT_MAX,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_wait_sample_interval",
+		.guc_desc = "Sets the interval in milliseconds between two samples of the wait events while backends are active.",
+		.guc_default = 1,
+		.guc_min = 1,
+		.guc_max = 1000,
+		.guc_restart = false
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_wait_sample_max_interval",
+		.guc_desc = "Sets the interval in milliseconds the wait event sampling backs off to while the server is idle.",
+		.guc_default = 100,
+		.guc_min = 1,
+		.guc_max = 10000,
+		.guc_restart = false
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_wait_workers",
+		.guc_desc = "Sets the number of collector workers sampling the wait events.",
+		.guc_default = 1,
+		.guc_min = 1,
+		.guc_max = MAX_WAIT_WORKERS,
+		.guc_restart = true
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_track_plans",
+		.guc_desc = "Selects whether statistics and text are kept for each plan of a statement.",
+		.guc_default = 0,
+		.guc_min = 0,
+		.guc_max = 0,
+		.guc_restart = false
+	};
+
+	conf[i++] = (GucVariable) { 
+		.guc_name = "pg_stat_monitor.pgsm_agg_port_range",
+		.guc_desc = "Sets the width of the client port ranges statistics are aggregated by.",
+		.guc_default = 1024,
+		.guc_min = 1,
+		.guc_max = 65536,
+		.guc_restart = true
+	};
 	
 	DefineCustomIntVariable("pg_stat_monitor.max",
 							"Sets the maximum number of statements tracked by pg_stat_monitor.",
@@ -190,7 +348,7 @@ init_guc(void)
 							&PGSM_MAX_BUCKETS,
 							10,
 							1,
-							10,
+							MAX_BUCKETS,
 							PGC_POSTMASTER,
 							0,
 							NULL,
@@ -273,5 +431,273 @@ init_guc(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomEnumVariable("pg_stat_monitor.pgsm_timing",
+							 "Selects how statement execution time is measured.",
+							 "\"full\" instruments the executor run, \"fast\" only reads the clock at statement start and end.",
+							 &PGSM_TIMING,
+							 PGSM_TIMING_FULL,
+							 timing_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_sample_rate",
+							"Sets the percentage of statement executions that are tracked.",
+							NULL,
+							&PGSM_SAMPLE_RATE,
+							100,
+							1,
+							100,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_sample_slow_threshold",
+							"Sets the execution time in millisecond above which statements are tracked regardless of sampling.",
+							"Zero disables it.",
+							&PGSM_SAMPLE_SLOW_THRESHOLD,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_stat_monitor.pgsm_topk",
+							 "Selects which queries are kept when a bucket is full.",
+							 "\"none\" drops new queries, \"calls\" and \"total_time\" evict the lightest query by that measure.",
+							 &PGSM_TOPK,
+							 PGSM_TOPK_NONE,
+							 topk_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_max_database",
+							"Sets the maximum number of per-database aggregates.",
+							NULL,
+							&PGSM_AGG_MAX(AGG_KEY_DATABASE),
+							5000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_max_user",
+							"Sets the maximum number of per-user aggregates.",
+							NULL,
+							&PGSM_AGG_MAX(AGG_KEY_USER),
+							5000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_max_host",
+							"Sets the maximum number of per-host aggregates.",
+							NULL,
+							&PGSM_AGG_MAX(AGG_KEY_HOST),
+							5000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_max_application_name",
+							"Sets the maximum number of per-application aggregates.",
+							NULL,
+							&PGSM_AGG_MAX(AGG_KEY_APPNAME),
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_max_tag",
+							"Sets the maximum number of per-tag aggregates.",
+							NULL,
+							&PGSM_AGG_MAX(AGG_KEY_TAG),
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_max_client_port",
+							"Sets the maximum number of per-client-port-range aggregates.",
+							NULL,
+							&PGSM_AGG_MAX(AGG_KEY_CLIENT_PORT),
+							1000,
+							100,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_wait_sample_interval",
+							"Sets the interval in milliseconds between two samples of the wait events while backends are active.",
+							NULL,
+							&PGSM_WAIT_SAMPLE_INTERVAL,
+							1,
+							1,
+							1000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_wait_sample_max_interval",
+							"Sets the interval in milliseconds the wait event sampling backs off to while the server is idle.",
+							NULL,
+							&PGSM_WAIT_SAMPLE_MAX_INTERVAL,
+							100,
+							1,
+							10000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_wait_workers",
+							"Sets the number of collector workers sampling the wait events.",
+							"Each worker samples its own stripe of the server processes.",
+							&PGSM_WAIT_WORKERS,
+							1,
+							1,
+							MAX_WAIT_WORKERS,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_stat_monitor.pgsm_track_plans",
+							 "Selects whether statistics and text are kept for each plan of a statement.",
+							 NULL,
+							 (bool*)&PGSM_TRACK_PLANS,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_agg_port_range",
+							"Sets the width of the client port ranges statistics are aggregated by.",
+							"Only used if \"client_port\" is one of pg_stat_monitor.pgsm_agg_dimensions.",
+							&PGSM_AGG_PORT_RANGE,
+							1024,
+							1,
+							65536,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_stat_monitor.pgsm_agg_dimensions",
+							   "Sets the dimensions statement statistics are aggregated by.",
+							   "A list of database, user, host, application_name, tag and client_port.",
+							   &pgsm_agg_dimensions_string,
+							   "database,user,host",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   check_agg_dimensions,
+							   assign_agg_dimensions,
+							   NULL);
+
+	DefineCustomStringVariable("pg_stat_monitor.pgsm_tag",
+							   "Sets the tag statement statistics of the session are aggregated by.",
+							   "Only used if \"tag\" is one of pg_stat_monitor.pgsm_agg_dimensions.",
+							   &pgsm_tag,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+}
+
+/*
+ * Parse pg_stat_monitor.pgsm_agg_dimensions into a bitmask of AGG_KEY.
+ */
+static bool
+check_agg_dimensions(char **newval, void **extra, GucSource source)
+{
+	char		*rawstring;
+	List		*elemlist;
+	ListCell	*l;
+	int			mask = 0;
+	int			*myextra;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		char	*name = (char *) lfirst(l);
+		int		i;
+
+		for (i = 0; i < AGG_KEY_COUNT; i++)
+		{
+			if (pg_strcasecmp(name, agg_dimension_names[i]) == 0)
+				break;
+		}
+		if (i == AGG_KEY_COUNT)
+		{
+			GUC_check_errdetail("Unrecognized dimension: \"%s\".", name);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+		mask |= (1 << i);
+	}
+	pfree(rawstring);
+	list_free(elemlist);
+
+	myextra = (int *) guc_malloc(ERROR, sizeof(int));
+	*myextra = mask;
+	*extra = (void *) myextra;
+	return true;
+}
+
+static void
+assign_agg_dimensions(const char *newval, void *extra)
+{
+	pgsm_agg_dimensions = *((int *) extra);
 }
 
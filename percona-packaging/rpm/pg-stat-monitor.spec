@@ -36,6 +36,9 @@ sed -i 's:PG_CONFIG = pg_config:PG_CONFIG = /usr/pgsql-11/bin/pg_config:' Makefi
 %install
 %{__rm} -rf %{buildroot}
 %{__make} USE_PGXS=1 %{?_smp_mflags} install DESTDIR=%{buildroot}
+# The planner hook of the regression tests is not shipped
+%{__rm} -f %{buildroot}%{pginstdir}/lib/pgsm_planner_counter.so
+%{__rm} -f %{buildroot}%{pginstdir}/lib/bitcode/pgsm_planner_counter.bc
 %{__install} -d %{buildroot}%{pginstdir}/share/extension
 %{__install} -m 755 README.md %{buildroot}%{pginstdir}/share/extension/README-pg_stat_monitor
 
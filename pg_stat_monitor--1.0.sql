@@ -14,8 +14,9 @@ CREATE FUNCTION pg_stat_monitor(IN showtext boolean,
     OUT userid oid,
     OUT dbid oid,
 
-    OUT queryid text,
+    OUT queryid int8,
     OUT query text,
+    OUT planid int8,
     OUT bucket_start_time timestamptz,
 
 	
@@ -34,6 +35,11 @@ CREATE FUNCTION pg_stat_monitor(IN showtext boolean,
     OUT mean_time float8,
     OUT stddev_time float8,
     OUT rows int8,
+    OUT samples int8,
+    OUT topk_error float8,
+    OUT generic_plan_calls int8,
+    OUT custom_plan_calls int8,
+    OUT replan_time float8,
     
 	OUT shared_blks_hit int8,
     OUT shared_blks_read int8,
@@ -47,18 +53,29 @@ CREATE FUNCTION pg_stat_monitor(IN showtext boolean,
     OUT temp_blks_written int8,
     OUT blk_read_time float8,
     OUT blk_write_time float8,
-    OUT client_ip bigint,
-    OUT resp_calls text,
+    OUT host bigint,
+    OUT client_ip inet,
+    OUT resp_calls int8[],
     OUT cpu_user_time float8,
     OUT cpu_sys_time  float8,
+    OUT lock_wait_time float8,
+    OUT lwlock_wait_time float8,
+    OUT io_wait_time float8,
+    OUT ipc_wait_time float8,
+    OUT client_wait_time float8,
     OUT tables_names text
 )
 RETURNS SETOF record
 AS 'MODULE_PATHNAME', 'pg_stat_monitor'
 LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
 
+CREATE FUNCTION pg_stat_monitor_text(IN bucket int, IN queryid int8, IN userid oid, IN dbid oid)
+RETURNS text
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_text'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
 CREATE FUNCTION pg_stat_wait_events(
-  OUT queryid text, 
+  OUT queryid int8, 
   OUT pid bigint, 
   OUT wait_event text, 
   OUT wait_event_type text 
@@ -90,15 +107,88 @@ CREATE VIEW pg_stat_monitor_settings AS SELECT
     restart
 FROM pg_stat_monitor_settings();
 
+CREATE FUNCTION pg_stat_monitor_query_buffer(
+    OUT size int8,
+    OUT used int8,
+    OUT texts int8,
+    OUT bucket_refs int8,
+    OUT spilled_texts int8,
+    OUT file_size int8,
+    OUT raw_bytes int8,
+    OUT stored_bytes int8,
+    OUT evicted int8,
+    OUT dropped int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_query_buffer'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_stat_monitor_query_buffer AS SELECT
+    size,
+    used,
+    texts,
+    bucket_refs,
+    spilled_texts,
+    file_size,
+    raw_bytes,
+    stored_bytes,
+    round(CAST(raw_bytes AS numeric) / NULLIF(stored_bytes, 0), 2) AS compression_ratio,
+    evicted,
+    dropped
+FROM pg_stat_monitor_query_buffer();
+
 CREATE FUNCTION pg_stat_agg(
-  OUT queryid text, 
-  OUT id bigint, 
-  OUT type bigint, 
-  OUT total_calls int)
+  OUT bucket int,
+  OUT queryid int8,
+  OUT id bigint,
+  OUT type bigint,
+  OUT label text,
+  OUT userid oid,
+  OUT dbid oid,
+  OUT host bigint,
+  OUT client_ip inet,
+  OUT total_calls int8,
+  OUT rows int8,
+  OUT total_time float8,
+  OUT min_time float8,
+  OUT max_time float8,
+  OUT mean_time float8,
+  OUT shared_blks_hit int8,
+  OUT shared_blks_read int8,
+  OUT resp_calls int8[],
+  OUT cpu_user_time float8,
+  OUT cpu_sys_time float8,
+  OUT tables_names text)
 RETURNS SETOF record
 AS 'MODULE_PATHNAME', 'pg_stat_agg'
 LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
 
+CREATE FUNCTION pg_stat_agg_usage(
+  OUT dimension text,
+  OUT enabled boolean,
+  OUT entries int8,
+  OUT capacity int8,
+  OUT overflow int8,
+  OUT evicted int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_agg_usage'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_stat_agg_usage AS SELECT
+  dimension,
+  enabled,
+  entries,
+  capacity,
+  overflow,
+  evicted
+FROM pg_stat_agg_usage();
+
+-- Display a queryid the way it used to be reported, as upper-case hex.
+CREATE FUNCTION pg_stat_monitor_queryid_hex(IN queryid int8)
+RETURNS text
+AS $$ SELECT upper(lpad(to_hex(queryid), 16, '0')) $$
+LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
+
 -- Register a view on the function for ease of use.
 CREATE VIEW pg_stat_monitor AS SELECT
     bucket,
@@ -106,7 +196,9 @@ CREATE VIEW pg_stat_monitor AS SELECT
     userid,
     dbid,
     m.queryid,
-    query,
+	CASE WHEN m.queryid IS NULL THEN '<insufficient privilege>'
+		ELSE pg_stat_monitor_text(m.bucket, m.queryid, m.userid, m.dbid) END AS query,
+	planid,
 	plan_calls,
 	round( CAST(plan_total_time as numeric), 2) as plan_total_time,
 	round( CAST(plan_min_time as numeric), 2) as plan_min_timei,
@@ -121,6 +213,11 @@ CREATE VIEW pg_stat_monitor AS SELECT
 	round( CAST(mean_time as numeric), 2)as mean_time,
 	round( CAST(stddev_time as numeric), 2)as stddev_time,
 	rows,
+	samples,
+	topk_error,
+	generic_plan_calls,
+	custom_plan_calls,
+	round( CAST(replan_time as numeric), 2) as replan_time,
     shared_blks_hit,
     shared_blks_read,
     shared_blks_dirtied,
@@ -133,96 +230,327 @@ CREATE VIEW pg_stat_monitor AS SELECT
     temp_blks_written,
     blk_read_time,
     blk_write_time,
-	client_ip as host,
-	'0.0.0.0'::inet + client_ip AS client_ip,
-	(string_to_array(resp_calls, ',')) resp_calls,
+	host,
+	client_ip,
+	resp_calls,
     cpu_user_time,
     cpu_sys_time,
+	lock_wait_time,
+	lwlock_wait_time,
+	io_wait_time,
+	ipc_wait_time,
+	client_wait_time,
 	(string_to_array(tables_names, ',')) tables_names,
 	wait_event,
 	wait_event_type 
-from  pg_stat_monitor(true) m LEFT OUTER JOIN pg_stat_wait_events() w ON w.queryid = m.queryid;
+from  pg_stat_monitor(false) m LEFT OUTER JOIN pg_stat_wait_events() w ON w.queryid = m.queryid;
+
+-- Same as pg_stat_monitor, without the query texts and wait events.
+CREATE VIEW pg_stat_monitor_stats AS SELECT
+    bucket,
+	bucket_start_time,
+    userid,
+    dbid,
+    queryid,
+	planid,
+	plan_calls,
+	plan_total_time,
+	plan_min_time,
+	plan_max_time,
+	plan_mean_time,
+	plan_stddev_time,
+	plan_rows,
+    calls,
+	total_time,
+	min_time,
+	max_time,
+	mean_time,
+	stddev_time,
+	rows,
+	samples,
+	topk_error,
+	generic_plan_calls,
+	custom_plan_calls,
+	replan_time,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    blk_read_time,
+    blk_write_time,
+	host,
+	client_ip,
+	resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+	lock_wait_time,
+	lwlock_wait_time,
+	io_wait_time,
+	ipc_wait_time,
+	client_wait_time
+from  pg_stat_monitor(false);
 
 
 -- Register a view on the function for ease of use.
 CREATE VIEW pg_stat_wait_events AS SELECT
     m.queryid,
-    query,
+	pg_stat_monitor_text(m.bucket, m.queryid, m.userid, m.dbid) AS query,
 	wait_event,
 	wait_event_type 
-FROM  pg_stat_monitor(true) m, pg_stat_wait_events() w WHERE w.queryid = m.queryid;
+FROM  pg_stat_monitor(false) m, pg_stat_wait_events() w WHERE w.queryid = m.queryid;
 
 GRANT SELECT ON pg_stat_wait_events TO PUBLIC;
+
+CREATE FUNCTION pg_stat_monitor_plans(
+  OUT bucket int,
+  OUT userid oid,
+  OUT dbid oid,
+  OUT queryid int8,
+  OUT planid int8,
+  OUT query_plan text,
+  OUT calls int8,
+  OUT total_time float8,
+  OUT min_time float8,
+  OUT max_time float8,
+  OUT mean_time float8,
+  OUT rows int8,
+  OUT first_seen timestamptz,
+  OUT last_seen timestamptz
+  )
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_plans'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Statistics per plan of each statement, with pg_stat_monitor.pgsm_track_plans
+CREATE VIEW pg_stat_monitor_plans AS SELECT
+    bucket,
+	userid,
+	dbid,
+	queryid,
+	planid,
+	query_plan,
+	calls,
+	round( CAST(total_time as numeric), 2) as total_time,
+	round( CAST(min_time as numeric), 2) as min_time,
+	round( CAST(max_time as numeric), 2) as max_time,
+	round( CAST(mean_time as numeric), 2) as mean_time,
+	rows,
+	first_seen,
+	last_seen
+FROM pg_stat_monitor_plans();
+
+GRANT SELECT ON pg_stat_monitor_plans TO PUBLIC;
+
+CREATE FUNCTION pg_stat_wait_profile(
+  OUT bucket int,
+  OUT queryid int8,
+  OUT wait_event_type text,
+  OUT wait_event text,
+  OUT samples int8,
+  OUT total_time float8
+  )
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_wait_profile'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Share of the sampled time of each query spent in each wait event; a NULL
+-- wait event means the query was running.
+CREATE VIEW pg_stat_wait_profile AS SELECT
+    bucket,
+    queryid,
+	wait_event_type,
+	wait_event,
+	samples,
+	total_time,
+	round((100.0 * total_time / nullif(sum(total_time) OVER (PARTITION BY bucket, queryid), 0))::numeric, 2) AS percent
+FROM pg_stat_wait_profile();
+
+GRANT SELECT ON pg_stat_wait_profile TO PUBLIC;
+
+CREATE FUNCTION pg_stat_wait_sampler(
+  OUT worker int4,
+  OUT sample_interval int4,
+  OUT active_backends int4,
+  OUT sample_rate float8,
+  OUT samples int8
+  )
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_wait_sampler'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Current interval (ms) and achieved rate (samples per second) of each
+-- wait event collector.
+CREATE VIEW pg_stat_wait_sampler AS SELECT
+    worker,
+	sample_interval,
+	active_backends,
+	sample_rate,
+	samples
+FROM pg_stat_wait_sampler();
+
+GRANT SELECT ON pg_stat_wait_sampler TO PUBLIC;
 GRANT SELECT ON pg_stat_monitor TO PUBLIC;
+GRANT SELECT ON pg_stat_monitor_stats TO PUBLIC;
 
 CREATE VIEW pg_stat_agg_database AS
 SELECT
-  ss.bucket,
-  agg.queryid,
-  agg.id AS dbid,
-  ss.userid,
+  bucket,
+  queryid,
+  id AS dbid,
+  userid,
   client_ip,
-  agg.total_calls,
-  ss.min_time,
-  ss.max_time,
-  ss.mean_time,
-  ss.resp_calls,
-  ss.cpu_user_time,
-  ss.cpu_sys_time,
-  ss.query,
-  ss.tables_names
-FROM pg_stat_agg() agg 
-INNER JOIN (SELECT DISTINCT bucket, queryid, dbid, userid, query, client_ip, min_time, max_time, mean_time, resp_calls, tables_names, cpu_user_time,cpu_sys_time
-FROM pg_stat_monitor) ss 
-ON agg.queryid = ss.queryid AND agg.type = 0 AND id = dbid;
+  total_calls,
+  total_time,
+  min_time,
+  max_time,
+  mean_time,
+  rows,
+  shared_blks_hit,
+  shared_blks_read,
+  resp_calls,
+  cpu_user_time,
+  cpu_sys_time,
+  pg_stat_monitor_text(bucket, queryid, userid, dbid) AS query,
+  (string_to_array(tables_names, ',')) tables_names
+FROM pg_stat_agg()
+WHERE type = 0;
 
 CREATE VIEW pg_stat_agg_user AS
 SELECT
-  ss.bucket,
-  agg.queryid,
-  agg.id AS dbid,
-  ss.userid,
+  bucket,
+  queryid,
+  id AS dbid,
+  userid,
   client_ip,
-  agg.total_calls,
-  ss.min_time,
-  ss.max_time,
-  ss.mean_time,
-  ss.resp_calls,
-  ss.cpu_user_time,
-  ss.cpu_sys_time,
-  ss.query,
-  ss.tables_names
-FROM pg_stat_agg() agg 
-INNER JOIN (SELECT DISTINCT bucket, queryid, userid, query, client_ip, min_time, max_time, mean_time, resp_calls, tables_names, cpu_user_time,cpu_sys_time FROM pg_stat_monitor) ss 
-ON agg.queryid = ss.queryid AND agg.type = 1 AND id = userid;
+  total_calls,
+  total_time,
+  min_time,
+  max_time,
+  mean_time,
+  rows,
+  shared_blks_hit,
+  shared_blks_read,
+  resp_calls,
+  cpu_user_time,
+  cpu_sys_time,
+  pg_stat_monitor_text(bucket, queryid, userid, dbid) AS query,
+  (string_to_array(tables_names, ',')) tables_names
+FROM pg_stat_agg()
+WHERE type = 1;
 
 CREATE VIEW pg_stat_agg_ip AS
 SELECT
-  ss.bucket,
-  agg.queryid,
-  agg.id AS dbid,
-  ss.userid,
-  ss.client_ip,
-  ss.host,
-  agg.total_calls,
-  ss.min_time,
-  ss.max_time,
-  ss.mean_time,
-  ss.resp_calls,
-  ss.cpu_user_time,
-  ss.cpu_sys_time,
-  ss.query,
-  ss.tables_names
-FROM pg_stat_agg() agg 
-INNER JOIN (SELECT DISTINCT bucket, queryid, userid, query, client_ip, host, min_time, max_time, mean_time, resp_calls, tables_names, cpu_user_time,cpu_sys_time FROM pg_stat_monitor) ss 
-ON agg.queryid = ss.queryid AND agg.type = 2 AND id = host;
+  bucket,
+  queryid,
+  id AS dbid,
+  userid,
+  client_ip,
+  host,
+  total_calls,
+  total_time,
+  min_time,
+  max_time,
+  mean_time,
+  rows,
+  shared_blks_hit,
+  shared_blks_read,
+  resp_calls,
+  cpu_user_time,
+  cpu_sys_time,
+  pg_stat_monitor_text(bucket, queryid, userid, dbid) AS query,
+  (string_to_array(tables_names, ',')) tables_names
+FROM pg_stat_agg()
+WHERE type = 2;
+
+CREATE VIEW pg_stat_agg_application AS
+SELECT
+  bucket,
+  queryid,
+  label AS application_name,
+  userid,
+  dbid,
+  client_ip,
+  total_calls,
+  total_time,
+  min_time,
+  max_time,
+  mean_time,
+  rows,
+  shared_blks_hit,
+  shared_blks_read,
+  resp_calls,
+  cpu_user_time,
+  cpu_sys_time,
+  pg_stat_monitor_text(bucket, queryid, userid, dbid) AS query,
+  (string_to_array(tables_names, ',')) tables_names
+FROM pg_stat_agg()
+WHERE type = 3;
+
+CREATE VIEW pg_stat_agg_tag AS
+SELECT
+  bucket,
+  queryid,
+  label AS tag,
+  userid,
+  dbid,
+  client_ip,
+  total_calls,
+  total_time,
+  min_time,
+  max_time,
+  mean_time,
+  rows,
+  shared_blks_hit,
+  shared_blks_read,
+  resp_calls,
+  cpu_user_time,
+  cpu_sys_time,
+  pg_stat_monitor_text(bucket, queryid, userid, dbid) AS query,
+  (string_to_array(tables_names, ',')) tables_names
+FROM pg_stat_agg()
+WHERE type = 4;
+
+CREATE VIEW pg_stat_agg_client_port AS
+SELECT
+  bucket,
+  queryid,
+  label AS client_ports,
+  userid,
+  dbid,
+  client_ip,
+  total_calls,
+  total_time,
+  min_time,
+  max_time,
+  mean_time,
+  rows,
+  shared_blks_hit,
+  shared_blks_read,
+  resp_calls,
+  cpu_user_time,
+  cpu_sys_time,
+  pg_stat_monitor_text(bucket, queryid, userid, dbid) AS query,
+  (string_to_array(tables_names, ',')) tables_names
+FROM pg_stat_agg()
+WHERE type = 5;
 
 
 
 GRANT SELECT ON pg_stat_agg_user TO PUBLIC;
 GRANT SELECT ON pg_stat_agg_ip TO PUBLIC;
 GRANT SELECT ON pg_stat_agg_database TO PUBLIC;
+GRANT SELECT ON pg_stat_agg_application TO PUBLIC;
+GRANT SELECT ON pg_stat_agg_tag TO PUBLIC;
+GRANT SELECT ON pg_stat_agg_client_port TO PUBLIC;
+GRANT SELECT ON pg_stat_agg_usage TO PUBLIC;
 GRANT SELECT ON pg_stat_monitor_settings TO PUBLIC;
+GRANT SELECT ON pg_stat_monitor_query_buffer TO PUBLIC;
 
 -- Don't want this to be available to non-superusers.
 REVOKE ALL ON FUNCTION pg_stat_monitor_reset() FROM PUBLIC;
@@ -29,12 +29,33 @@ static int	nested_level = 0;
 static int	plan_nested_level = 0;
 static int	exec_nested_level = 0;
 #endif
-static struct rusage  rusage_start;
-static struct rusage  rusage_end;
+/* Tracked statements between ExecutorStart and ExecutorEnd, innermost first */
+static dlist_head exec_states = DLIST_STATIC_INIT(exec_states);
+
+/* Plans built but not executed yet, to tell reused plans from fresh ones */
+static pgssRecentPlan recent_plans[MAX_RECENT_PLANS];
+static int	recent_plans_next = 0;
+
+/* Calibrated TSC rate, zero if the TSC can't be used as a clock */
+static double tsc_ticks_per_usec = 0;
+
+/*
+ * Records moved to the query file while pgss->lock was held exclusively.
+ * Their space in the file is reserved at once; the bytes are written by
+ * qtext_flush() after the lock is released.
+ */
+static StringInfo qtext_pending = NULL;
+static Size qtext_pending_off = 0;
+
+/* xorshift state for statement sampling, seeded on first use */
+static uint64 sample_seed = 0;
+
 static volatile sig_atomic_t sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
 static void handle_sigterm(SIGNAL_ARGS);
+static void handle_sighup(SIGNAL_ARGS);
 
-int query_buf_size_bucket;
+uint64 query_buf_size;
 HTAB *
 CreateHash(const char *hash_name, int key_size, int entry_size, int hash_size);
 
@@ -53,33 +74,56 @@ static pgssSharedState *pgss = NULL;
 static HTAB *pgss_hash = NULL;
 static HTAB *pgss_object_hash = NULL;
 
+/* Hash table for query texts, shared by all buckets */
+static HTAB *pgss_texthash = NULL;
+
 /* Hash table for aggegates */
 static HTAB *pgss_agghash = NULL;
 
 /* Hash table for aggegates */
 static HTAB *pgss_buckethash = NULL;
 
-/* Hash table for wait events */
-static HTAB *pgss_waiteventshash = NULL;
+/* Wait events of the backends, indexed like ProcGlobal->allProcs */
+static pgssWaitEventEntry *pgssWaitEventEntries = NULL;
+
+/* Hash table for the per-query wait profiles */
+static HTAB *pgss_waitprofilehash = NULL;
+
+/* Hash table for the per-plan statistics */
+static HTAB *pgss_planhash = NULL;
 
 static pgssBucketEntry **pgssBucketEntries = NULL;
-static pgssWaitEventEntry **pgssWaitEventEntries = NULL;
 
 
 PG_FUNCTION_INFO_V1(pg_stat_monitor_reset);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_1_2);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_1_3);
 PG_FUNCTION_INFO_V1(pg_stat_monitor);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_text);
 PG_FUNCTION_INFO_V1(pg_stat_wait_events);
+PG_FUNCTION_INFO_V1(pg_stat_wait_profile);
+PG_FUNCTION_INFO_V1(pg_stat_wait_sampler);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_plans);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_settings);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_query_buffer);
 
 /* Extended version function prototypes */
 PG_FUNCTION_INFO_V1(pg_stat_agg);
+PG_FUNCTION_INFO_V1(pg_stat_agg_usage);
 static uint pg_get_client_addr(void);
+static int pg_get_client_port_range(void);
+static Datum client_ip_datum(uint host);
 static Datum array_get_datum(int arr[]);
 
-static void update_agg_counters(uint64 bucket_id, uint64 queryid, uint64 id, AGG_KEY type);
-static pgssAggEntry *agg_entry_alloc(pgssAggHashKey *key);
+static bool update_agg_counters(uint64 bucket_id, uint64 queryid, Oid userid, Oid dbid, uint host,
+								double total_time, uint64 rows, double weight,
+								const BufferUsage *bufusage, float utime, float stime,
+								bool create);
+static int get_resp_bucket(double total_time);
+static pgssAggEntry *agg_entry_alloc(pgssAggHashKey *key, bool create);
+static void agg_entry_evict(uint64 type);
+static Size agg_capacity(void);
+static double agg_entry_weight(void *entry);
 void add_object_entry(uint64 queryid, char *objects);
 #if PG_VERSION_NUM >= 130000
 static PlannedStmt * pgss_planner_hook(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams);
@@ -112,28 +156,54 @@ static void pgss_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 #endif
 
 static uint64 pgss_hash_string(const char *str, int len);
+static const char *query_extent(const char *query, int *query_location, int *query_len);
+static uint64 pgsm_publish_queryid(uint64 queryid);
+static void remember_plan(PlannedStmt *plan, bool custom, double plan_time);
+static pgssPlanKind classify_plan(PlannedStmt *plan, double *plan_time);
+static void forget_plans(void);
+static void pgss_xact_callback(XactEvent event, void *arg);
+static void pgss_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								  SubTransactionId parentSubid, void *arg);
+static void pgsm_calibrate_tsc(void);
+static uint64 pgsm_get_ticks(void);
+static double pgsm_ticks_to_msec(uint64 ticks);
+static pgssExecState *exec_state_alloc(QueryDesc *queryDesc);
+static pgssExecState *exec_state_find(QueryDesc *queryDesc);
+static void exec_state_release(void *arg);
+static bool pgsm_sample_statement(void);
 static void pgss_store(const char *query, uint64 queryId,
 				int query_location, int query_len,
 				bool kind,
 				double total_time, uint64 rows,
+				double weight,
 				const BufferUsage *bufusage,
 #if PG_VERSION_NUM >= 130000
 				const WalUsage *walusage,
 #endif
 				pgssJumbleState *jstate,
-				float utime, float stime);
+				float utime, float stime,
+				pgssPlanKind plan_kind, double replan_time);
 
 static void pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 							bool showtext);
 static Size pgss_memsize(void);
 static pgssEntry *entry_alloc(pgssSharedState *pgss, pgssHashKey *key, Size query_offset, int query_len, int encoding, bool sticky);
 
+static double topk_weight(Counters *counters);
+static double topk_entry_weight(void *entry);
+static void topk_heap_reset(int bucket);
+static void topk_evict(pgssEntry *victim);
+static void heap_init(pgssHeap *heap, pgssHeapItem *items, int capacity, Size slot_offset);
+static void heap_push(pgssHeap *heap, void *entry, double weight);
+static void heap_remove(pgssHeap *heap, void *entry);
+static void *heap_min(pgssHeap *heap, pgssHeapWeight weight, int mode);
 static void entry_dealloc(int bucket_id);
 static void entry_reset(void);
 static void AppendJumble(pgssJumbleState *jstate,
 			 const unsigned char *item, Size size);
 static void JumbleQuery(pgssJumbleState *jstate, Query *query);
 static void JumbleRangeTable(pgssJumbleState *jstate, List *rtable);
+static void JumblePlan(pgssJumbleState *jstate, Plan *plan, List *rtable);
 static void JumbleExpr(pgssJumbleState *jstate, Node *node);
 static void RecordConstLocation(pgssJumbleState *jstate, int location);
 static char *generate_normalized_query(pgssJumbleState *jstate, const char *query,
@@ -144,14 +214,36 @@ static int comp_location(const void *a, const void *b);
 
 static uint64 get_next_wbucket(pgssSharedState *pgss);
 
-static void store_query(uint64 queryid, const char *query, uint64 query_len);
-static uint64 locate_query(uint64 bucket_id, uint64 queryid, char * query);
+static bool query_text_ref(uint64 bucket_id, pgssTextKind kind, uint64 id);
+static void store_query(uint64 bucket_id, pgssTextKind kind, uint64 id, const char *query, uint64 query_len);
+static text *locate_query(pgssTextKind kind, uint64 id, int encoding, char *qfile, Size qfile_size);
+static void query_text_unref(uint64 bucket_id, pgssTextKind kind, uint64 id);
+static void query_text_remove(pgssTextEntry *text);
+static void query_text_release(int bucket);
+static void qtext_gc_if_needed(void);
+static void qbuf_reclaim(uint64 need);
+static int64 qbuf_append(pgssQueryHdr *hdr, const char *text);
+static Size qtext_spill(pgssQueryHdr *hdr, const char *text);
+static void qtext_flush(void);
+static void qtext_shmem_exit(int code, Datum arg);
+static char *qtext_map(Size *size);
+static void text_map_release(void *arg);
+static void qtext_gc(void);
+static int32 compress_query_text(const char *query, int32 len, char *dest);
+static bool read_query_text(const unsigned char *src, uint32 len, uint32 raw_len, char *query);
 
 /* Wait Event Local Functions */
 static void register_wait_event(void);
 void wait_event_main(Datum main_arg);
-static void update_wait_event(void);
+static int update_wait_event(uint64 elapsed, int first, int step);
+static int next_wait_interval(int interval, int active);
+static void update_wait_profile(pgssWaitProfileKey *keys, int nkeys, uint64 elapsed);
+static void update_wait_counters(pgssWaitProfileKey *keys, pgssHashKey *stmts, int nkeys, uint64 elapsed);
 static uint64 get_query_id(pgssJumbleState *jstate, Query *query);
+static uint64 get_plan_id(PlannedStmt *pstmt);
+static void pgss_store_plan(QueryDesc *queryDesc, uint64 queryId, uint64 planid,
+							double total_time, uint64 rows, double weight);
+static char *explain_plan_text(QueryDesc *queryDesc, int *len);
 
 /*
  * Module load callback
@@ -171,9 +263,15 @@ _PG_init(void)
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
+	/* Query texts track the buckets using them in a 32-bit bitmap */
+	StaticAssertStmt(MAX_BUCKETS <= 32, "too many buckets for pgssTextEntry.refs");
+
 	/* Inilize the GUC variables */
 	init_guc();
 
+	/* Backends inherit the calibration from the postmaster */
+	pgsm_calibrate_tsc();
+
 	EmitWarningsOnPlaceholders("pg_stat_monitor");
 
 	/*
@@ -206,6 +304,10 @@ _PG_init(void)
 	ProcessUtility_hook 			= pgss_ProcessUtility;
 	planner_hook_next       		= planner_hook;
 	planner_hook            		= pgss_planner_hook;
+
+	/* Plans not executed by the end of their transaction are forgotten */
+	RegisterXactCallback(pgss_xact_callback, NULL);
+	RegisterSubXactCallback(pgss_subxact_callback, NULL);
 }
 
 /*
@@ -223,6 +325,8 @@ _PG_fini(void)
 	ExecutorFinish_hook 	= prev_ExecutorFinish;
 	ExecutorEnd_hook 		= prev_ExecutorEnd;
 	ProcessUtility_hook 	= prev_ProcessUtility;
+	UnregisterXactCallback(pgss_xact_callback, NULL);
+	UnregisterSubXactCallback(pgss_subxact_callback, NULL);
 	entry_reset();
 }
 
@@ -256,9 +360,12 @@ pgss_shmem_startup(void)
 	pgss = NULL;
 	pgss_hash = NULL;
 	pgss_object_hash = NULL;
+	pgss_texthash = NULL;
 	pgss_agghash = NULL;
 	pgss_buckethash = NULL;
-	pgss_waiteventshash = NULL;
+	pgssWaitEventEntries = NULL;
+	pgss_waitprofilehash = NULL;
+	pgss_planhash = NULL;
 
 	/*
 	 * Create or attach to the shared memory state, including hash table
@@ -268,15 +375,41 @@ pgss_shmem_startup(void)
 	pgss = ShmemInitStruct("pg_stat_monitor", sizeof(pgssSharedState), &found);
 	if (!found)
 	{
+		pgssHeapItem	*items;
+		int				per_bucket = PGSM_MAX / PGSM_MAX_BUCKETS;
+
 		/* First time through ... */
 		pgss->lock = &(GetNamedLWLockTranche("pg_stat_monitor"))->lock;
 		SpinLockInit(&pgss->mutex);
 		ResetSharedState(pgss);
+		ResetQueryBufStats(&pgss->qbuf_stats);
+
+		/* Each bucket holds at most PGSM_MAX / PGSM_MAX_BUCKETS entries */
+		items = ShmemAlloc(mul_size(sizeof(pgssHeapItem), PGSM_MAX));
+		for (i = 0; i < PGSM_MAX_BUCKETS; i++)
+			heap_init(&pgss->topk_heap[i], items + i * per_bucket, per_bucket,
+					  offsetof(pgssEntry, heap_slot));
+
+		/* Each dimension holds at most PGSM_AGG_MAX of its aggregates */
+		items = ShmemAlloc(mul_size(sizeof(pgssHeapItem), agg_capacity()));
+		for (i = 0; i < AGG_KEY_COUNT; i++)
+		{
+			heap_init(&pgss->agg_heap[i], items, PGSM_AGG_MAX(i),
+					  offsetof(pgssAggEntry, heap_slot));
+			items += PGSM_AGG_MAX(i);
+		}
+
+		/* Texts spilled by a previous postmaster are of no use */
+		unlink(PGSM_TEXT_FILE);
 	}
 
-	query_buf_size_bucket = PGSM_QUERY_BUF_SIZE / PGSM_MAX_BUCKETS;
-	for (i = 0; i < PGSM_MAX_BUCKETS; i++)
-		pgss_qbuf[i] = (unsigned char *) ShmemAlloc(query_buf_size_bucket);
+	query_buf_size = PGSM_QUERY_BUF_SIZE;
+	pgss_qbuf = (unsigned char *) ShmemAlloc(query_buf_size);
+
+	pgss_texthash = CreateHash("pg_stat_monitor: Query text hashtable",
+							sizeof(pgssTextHashKey),
+							sizeof(pgssTextEntry),
+							PGSM_TEXT_MAX);
 
 	pgss_hash = CreateHash("pg_stat_monitor: Queries hashtable",
 							sizeof(pgssHashKey),
@@ -288,10 +421,21 @@ pgss_shmem_startup(void)
 							sizeof(pgssBucketEntry),
 							PGSM_MAX_BUCKETS);
 
-	pgss_waiteventshash = CreateHash("pg_stat_monitor: Wait Event hashtable",
-							sizeof(pgssWaitEventKey),
-							sizeof(pgssWaitEventEntry),
-							100);
+	pgssWaitEventEntries = ShmemInitStruct("pg_stat_monitor: Wait events",
+							mul_size(sizeof(pgssWaitEventEntry), MAX_BACKEND_PROCESES),
+							&found);
+	if (!found)
+		memset(pgssWaitEventEntries, 0, mul_size(sizeof(pgssWaitEventEntry), MAX_BACKEND_PROCESES));
+
+	pgss_waitprofilehash = CreateHash("pg_stat_monitor: Wait profile hashtable",
+							sizeof(pgssWaitProfileKey),
+							sizeof(pgssWaitProfileEntry),
+							PGSM_MAX);
+
+	pgss_planhash = CreateHash("pg_stat_monitor: Plan hashtable",
+							sizeof(pgssPlanHashKey),
+							sizeof(pgssPlanEntry),
+							PGSM_MAX);
 
 	pgss_object_hash = CreateHash("pg_stat_monitor: Object hashtable",
 							sizeof(pgssObjectHashKey),
@@ -301,26 +445,10 @@ pgss_shmem_startup(void)
 	pgss_agghash = CreateHash("pg_stat_monitor: Aggregate hashtable",
 							sizeof(pgssAggHashKey),
 							sizeof(pgssAggEntry),
-							PGSM_MAX * 3);
+							agg_capacity());
 
 	Assert(IsHashInitialize());
 
-	pgssWaitEventEntries = malloc(sizeof (pgssWaitEventEntry) * MAX_BACKEND_PROCESES);
-	for (i = 0; i < MAX_BACKEND_PROCESES; i++)
-	{
-		pgssWaitEventKey	key;
-		pgssWaitEventEntry	*entry = NULL;
-		bool				found = false;
-
-		key.processid = i;
-		entry = (pgssWaitEventEntry *) hash_search(pgss_waiteventshash, &key, HASH_ENTER, &found);
-		if (!found)
-		{
-			SpinLockInit(&entry->mutex);
-			pgssWaitEventEntries[i] = entry;
-		}
-	}
-
 	pgssBucketEntries = malloc(sizeof (pgssBucketEntry) * PGSM_MAX_BUCKETS);
 	for (i = 0; i < PGSM_MAX_BUCKETS; i++)
 	{
@@ -454,12 +582,15 @@ pgss_post_parse_analyze(ParseState *pstate, Query *query)
 				   PGSS_INVALID,
 				   0,
 				   0,
+				   1.0,
 				   NULL,
 #if PG_VERSION_NUM >= 130000
 				   NULL,
 #endif
 				   &jstate,
 				   0.0,
+				   0.0,
+				   PGSM_PLAN_NONE,
 				   0.0);
 }
 
@@ -469,8 +600,6 @@ pgss_post_parse_analyze(ParseState *pstate, Query *query)
 static void
 pgss_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-	getrusage(RUSAGE_SELF, &rusage_start);
-
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
@@ -483,6 +612,51 @@ pgss_ExecutorStart(QueryDesc *queryDesc, int eflags)
 	 */
 	if (PGSS_ENABLED() && queryDesc->plannedstmt->queryId != UINT64CONST(0))
 	{
+		pgssExecState	*state;
+		bool			sampled = pgsm_sample_statement();
+		uint64			prev_queryid;
+
+		/*
+		 * Let the wait event collector charge this backend's waits to the
+		 * statement until its executor memory is freed.  Cached plans never
+		 * go through the planner hook, so this is the only place to learn
+		 * the queryid.
+		 */
+		prev_queryid = pgsm_publish_queryid(queryDesc->plannedstmt->queryId);
+		state = exec_state_alloc(queryDesc);
+		state->prev_queryid = prev_queryid;
+		state->plan_kind = classify_plan(queryDesc->plannedstmt, &state->replan_time);
+
+		/*
+		 * A statement left out of the sample costs nothing more, unless we
+		 * still have to time it to catch slow executions.
+		 */
+		state->timed = (sampled || PGSM_SAMPLE_SLOW_THRESHOLD > 0);
+		if (!state->timed)
+			return;
+
+		state->sample_weight = sampled ? 100.0 / PGSM_SAMPLE_RATE : 0.0;
+		if (sampled)
+			getrusage(RUSAGE_SELF, &state->rusage_start);
+
+		/* Cached plans are fingerprinted too, so do it here, not in the planner */
+		state->planid = PGSM_TRACK_PLANS ? get_plan_id(queryDesc->plannedstmt) : 0;
+
+		/*
+		 * In fast mode only remember where the statement started; there is
+		 * no need to instrument every ExecutorRun call.
+		 */
+		state->fast = (PGSM_TIMING == PGSM_TIMING_FAST || !sampled);
+		if (state->fast)
+		{
+			state->bufusage_start = pgBufferUsage;
+#if PG_VERSION_NUM >= 130000
+			state->walusage_start = pgWalUsage;
+#endif
+			state->start_ticks = pgsm_get_ticks();
+			return;
+		}
+
 		/*
 		 * Set up to track total elapsed time in ExecutorRun.  Make sure the
 		 * space is allocated in the per-query context so it will go away at
@@ -552,42 +726,93 @@ pgss_ExecutorFinish(QueryDesc *queryDesc)
 static void
 pgss_ExecutorEnd(QueryDesc *queryDesc)
 {
-	float   utime;
-	float   stime;
-	uint64	queryId = queryDesc->plannedstmt->queryId;
+	float			utime = 0;
+	float			stime = 0;
+	double			total_time;
+	double			weight;
+	struct rusage	rusage_end;
+	BufferUsage		bufusage;
+#if PG_VERSION_NUM >= 130000
+	WalUsage		walusage;
+#endif
+	uint64			queryId = queryDesc->plannedstmt->queryId;
+	pgssExecState	*state = exec_state_find(queryDesc);
 
-	if (queryId != UINT64CONST(0) && queryDesc->totaltime && PGSS_ENABLED())
+	if (queryId != UINT64CONST(0) && state && state->timed && PGSS_ENABLED())
 	{
+		if (state->fast)
+		{
+			total_time = pgsm_ticks_to_msec(pgsm_get_ticks() - state->start_ticks);
+
+			memset(&bufusage, 0, sizeof(BufferUsage));
+			BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &state->bufusage_start);
+#if PG_VERSION_NUM >= 130000
+			memset(&walusage, 0, sizeof(WalUsage));
+			WalUsageAccumDiff(&walusage, &pgWalUsage, &state->walusage_start);
+#endif
+		}
+		else
+		{
+			/*
+			 * Make sure stats accumulation is done.  (Note: it's okay if several
+			 * levels of hook all do this.)
+			 */
+			InstrEndLoop(queryDesc->totaltime);
+			total_time = queryDesc->totaltime->total * 1000.0;	/* convert to msec */
+			bufusage = queryDesc->totaltime->bufusage;
+#if PG_VERSION_NUM >= 130000
+			walusage = queryDesc->totaltime->walusage;
+#endif
+		}
+
 		/*
-		 * Make sure stats accumulation is done.  (Note: it's okay if several
-		 * levels of hook all do this.)
+		 * Slow executions are always kept, so they represent only themselves;
+		 * sampled ones stand for 1/rate executions.
 		 */
-		InstrEndLoop(queryDesc->totaltime);
-		getrusage(RUSAGE_SELF, &rusage_end);
-		utime = TIMEVAL_DIFF(rusage_start.ru_utime, rusage_end.ru_utime);
-		stime = TIMEVAL_DIFF(rusage_start.ru_stime, rusage_end.ru_stime);
-
-		pgss_store(queryDesc->sourceText,
-				   queryId,
-				   queryDesc->plannedstmt->stmt_location,
-				   queryDesc->plannedstmt->stmt_len,
-				   PGSS_EXEC,
-				   queryDesc->totaltime->total * 1000.0,	/* convert to msec */
-				   queryDesc->estate->es_processed,
-				   &queryDesc->totaltime->bufusage,
+		if (PGSM_SAMPLE_SLOW_THRESHOLD > 0 && total_time >= PGSM_SAMPLE_SLOW_THRESHOLD)
+			weight = 1.0;
+		else
+			weight = state->sample_weight;
+
+		if (state->sample_weight > 0)
+		{
+			getrusage(RUSAGE_SELF, &rusage_end);
+			utime = TIMEVAL_DIFF(state->rusage_start.ru_utime, rusage_end.ru_utime);
+			stime = TIMEVAL_DIFF(state->rusage_start.ru_stime, rusage_end.ru_stime);
+		}
+
+		if (weight > 0)
+			pgss_store(queryDesc->sourceText,
+					   queryId,
+					   queryDesc->plannedstmt->stmt_location,
+					   queryDesc->plannedstmt->stmt_len,
+					   PGSS_EXEC,
+					   total_time,
+					   queryDesc->estate->es_processed,
+					   weight,
+					   &bufusage,
 #if PG_VERSION_NUM >= 130000
-				   &queryDesc->totaltime->walusage,
+					   &walusage,
 #endif
-				   NULL,
-				   utime,
-				   stime);
+					   NULL,
+					   utime,
+					   stime,
+					   state->plan_kind,
+					   state->replan_time);
+
+		/* The EXPLAIN text needs the plan state, which ExecutorEnd frees */
+		if (weight > 0 && state->planid != 0)
+			pgss_store_plan(queryDesc, queryId, state->planid, total_time,
+							queryDesc->estate->es_processed, weight);
 	}
-
+	/*
+	 * The state goes away with the executor memory, and its release gives
+	 * the waits back to the enclosing statement.
+	 */
 	if (prev_ExecutorEnd)
 		prev_ExecutorEnd(queryDesc);
 	else
 		standard_ExecutorEnd(queryDesc);
-
 }
 
 /*
@@ -631,6 +856,7 @@ static void pgss_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		instr_time	start;
 		instr_time	duration;
 		uint64		rows;
+		uint64		prev_queryid;
 		BufferUsage bufusage_start,
 					bufusage;
 #if PG_VERSION_NUM >= 130000
@@ -640,6 +866,15 @@ static void pgss_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		exec_nested_level++;
 #endif
 
+		/* Publish the same id pgss_store will give the statement */
+		{
+			int			location = pstmt->stmt_location;
+			int			len = pstmt->stmt_len;
+			const char	*stmt = query_extent(queryString, &location, &len);
+
+			prev_queryid = pgsm_publish_queryid(pgss_hash_string(stmt, len));
+		}
+
 		bufusage_start = pgBufferUsage;
 		INSTR_TIME_SET_CURRENT(start);
 
@@ -670,16 +905,21 @@ static void pgss_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		PG_FINALLY();
 		{
 			exec_nested_level--;
+			pgsm_publish_queryid(prev_queryid);
 		}
 #else
 		PG_CATCH();
         {
 			nested_level--;
+			pgsm_publish_queryid(prev_queryid);
 			PG_RE_THROW();
 
 		}
 #endif
 		PG_END_TRY();
+#if PG_VERSION_NUM < 130000
+		pgsm_publish_queryid(prev_queryid);
+#endif
 		INSTR_TIME_SET_CURRENT(duration);
 		INSTR_TIME_SUBTRACT(duration, start);
 
@@ -707,29 +947,33 @@ static void pgss_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 				   PGSS_EXEC,
 				   INSTR_TIME_GET_MILLISEC(duration),
 				   rows,
+				   1.0,
 				   &bufusage,
 #if PG_VERSION_NUM >= 130000
 				   &walusage,
 #endif
 				   NULL,
 				   0,
+				   0,
+				   PGSM_PLAN_NONE,
 				   0);
 	}
 	else
 	{
-			if (prev_ProcessUtility)
-				prev_ProcessUtility(pstmt, queryString,
-									context, params, queryEnv,
-									dest
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString,
+								context, params, queryEnv,
+								dest
 #if PG_VERSION_NUM >= 130000
-									,qc
+								,qc
 #else
-									,completionTag
+								,completionTag
 #endif
-									);
-				standard_ProcessUtility(pstmt, queryString,
-										context, params, queryEnv,
-										dest
+								);
+		else
+			standard_ProcessUtility(pstmt, queryString,
+									context, params, queryEnv,
+									dest
 #if PG_VERSION_NUM >= 130000
 									,qc
 #else
@@ -772,6 +1016,250 @@ pgss_hash_string(const char *str, int len)
 											len, 0));
 }
 
+/*
+ * Calibrate the TSC against the system clock.  The TSC is only used when the
+ * CPU advertises it as invariant, i.e. ticking at a constant rate regardless
+ * of frequency scaling and identical across cores.
+ */
+static void
+pgsm_calibrate_tsc(void)
+{
+#ifdef HAVE_PGSM_TSC
+	unsigned int	eax, ebx, ecx, edx;
+	instr_time		start;
+	instr_time		duration;
+	uint64			tsc_start;
+	uint64			tsc_end;
+	double			usec;
+
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & (1 << 8)) == 0)
+		return;
+
+	INSTR_TIME_SET_CURRENT(start);
+	tsc_start = __rdtsc();
+	pg_usleep(10000L);
+	tsc_end = __rdtsc();
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	usec = (double) INSTR_TIME_GET_MICROSEC(duration);
+	if (usec > 0 && tsc_end > tsc_start)
+		tsc_ticks_per_usec = (double) (tsc_end - tsc_start) / usec;
+#endif
+}
+
+/*
+ * Read the cheapest available clock: the TSC when calibrated, otherwise the
+ * system clock in microseconds.
+ */
+static uint64
+pgsm_get_ticks(void)
+{
+	instr_time	now;
+
+#ifdef HAVE_PGSM_TSC
+	if (tsc_ticks_per_usec > 0)
+		return __rdtsc();
+#endif
+	INSTR_TIME_SET_CURRENT(now);
+	return INSTR_TIME_GET_MICROSEC(now);
+}
+
+static double
+pgsm_ticks_to_msec(uint64 ticks)
+{
+	if (tsc_ticks_per_usec > 0)
+		return (double) ticks / tsc_ticks_per_usec / 1000.0;
+	return (double) ticks / 1000.0;
+}
+
+/*
+ * Allocate the state that remembers the start of a statement.  It lives in
+ * the statement's executor memory, and a reset callback unlinks it when
+ * that memory is freed, at ExecutorEnd or when an error cleans it up.  The
+ * QueryDesc cannot be recycled before then, so matching by address is safe.
+ */
+static pgssExecState *
+exec_state_alloc(QueryDesc *queryDesc)
+{
+	MemoryContext	cxt = queryDesc->estate->es_query_cxt;
+	pgssExecState	*state;
+
+	state = (pgssExecState *) MemoryContextAllocZero(cxt, sizeof(pgssExecState));
+	state->queryDesc = queryDesc;
+	state->cleanup.func = exec_state_release;
+	state->cleanup.arg = state;
+	MemoryContextRegisterResetCallback(cxt, &state->cleanup);
+	dlist_push_head(&exec_states, &state->node);
+	return state;
+}
+
+static pgssExecState *
+exec_state_find(QueryDesc *queryDesc)
+{
+	dlist_iter	iter;
+
+	/* The statement ending is almost always the innermost one */
+	dlist_foreach(iter, &exec_states)
+	{
+		pgssExecState	*state = dlist_container(pgssExecState, node, iter.cur);
+
+		if (state->queryDesc == queryDesc)
+			return state;
+	}
+	return NULL;
+}
+
+/*
+ * Reset callback of es_query_cxt: the statement is gone, whether it ended
+ * or was aborted by an error.  If it was the innermost live statement, the
+ * queryid it replaced is published again.  Otherwise, as when an error
+ * frees an outer executor first, the statement nested in it inherits that
+ * queryid, so that the chain is unwound right in any order.
+ */
+static void
+exec_state_release(void *arg)
+{
+	pgssExecState	*state = (pgssExecState *) arg;
+
+	if (dlist_has_prev(&exec_states, &state->node))
+	{
+		pgssExecState	*inner;
+
+		inner = dlist_container(pgssExecState, node,
+								dlist_prev_node(&exec_states, &state->node));
+		inner->prev_queryid = state->prev_queryid;
+	}
+	else
+		pgsm_publish_queryid(state->prev_queryid);
+
+	dlist_delete(&state->node);
+}
+
+/*
+ * Make queryid the statement this backend's sampled wait events are charged
+ * to, and return the previous one.
+ */
+static uint64
+pgsm_publish_queryid(uint64 queryid)
+{
+	pgssWaitEventEntry	*entry;
+	uint64				prev;
+
+	if (MyProc == NULL || pgssWaitEventEntries == NULL)
+		return 0;
+
+	entry = &pgssWaitEventEntries[MyProc - ProcGlobal->allProcs];
+	prev = entry->queryid;
+	entry->userid = GetUserId();
+	entry->dbid = MyDatabaseId;
+	entry->queryid = queryid;
+	return prev;
+}
+
+/*
+ * Remember a plan the planner just built, until it is executed.
+ */
+static void
+remember_plan(PlannedStmt *plan, bool custom, double plan_time)
+{
+	pgssRecentPlan	*recent = &recent_plans[recent_plans_next];
+
+	recent_plans_next = (recent_plans_next + 1) % MAX_RECENT_PLANS;
+	recent->plan = plan;
+	recent->queryid = plan->queryId;
+	recent->custom = custom;
+	recent->plan_time = plan_time;
+}
+
+/*
+ * Tell how the plan about to be executed was obtained.  A plan that was not
+ * built since its last execution comes from the plan cache and is generic;
+ * one that was just built with parameter values is a custom plan, and its
+ * planning time is returned in plan_time.
+ */
+static pgssPlanKind
+classify_plan(PlannedStmt *plan, double *plan_time)
+{
+	int		i;
+
+	*plan_time = 0;
+	for (i = 0; i < MAX_RECENT_PLANS; i++)
+	{
+		pgssRecentPlan	*recent = &recent_plans[i];
+
+		/* The address alone may be that of a freed plan reused */
+		if (recent->plan != plan || recent->queryid != plan->queryId)
+			continue;
+
+		/* Consume it: executing the same plan again means it was reused */
+		recent->plan = NULL;
+		if (!recent->custom)
+			return PGSM_PLAN_NONE;
+		*plan_time = recent->plan_time;
+		return PGSM_PLAN_CUSTOM;
+	}
+	return PGSM_PLAN_GENERIC;
+}
+
+/*
+ * Forget the plans not executed yet.  Their memory may be freed once their
+ * transaction is over, and another plan allocated at the same address.
+ */
+static void
+forget_plans(void)
+{
+	memset(recent_plans, 0, sizeof(recent_plans));
+	recent_plans_next = 0;
+}
+
+static void
+pgss_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			forget_plans();
+			/* Records queued by a statement that errored out */
+			qtext_flush();
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+pgss_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					  SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		forget_plans();
+}
+
+/*
+ * Decide whether the statement about to run is part of the sample, using a
+ * per-backend xorshift generator so that the decision costs a few cycles.
+ */
+static bool
+pgsm_sample_statement(void)
+{
+	if (PGSM_SAMPLE_RATE >= 100)
+		return true;
+
+	if (sample_seed == 0)
+		sample_seed = (((uint64) MyProcPid << 32) ^ (uint64) GetCurrentTimestamp()) | 1;
+
+	sample_seed ^= sample_seed << 13;
+	sample_seed ^= sample_seed >> 7;
+	sample_seed ^= sample_seed << 17;
+
+	return (sample_seed % 100) < (uint64) PGSM_SAMPLE_RATE;
+}
+
 static uint
 pg_get_client_addr(void)
 {
@@ -808,6 +1296,83 @@ pg_get_client_addr(void)
 }
 
 
+/*
+ * First port of the pg_stat_monitor.pgsm_agg_port_range wide range the
+ * client port falls in, or -1 if the session has no client port.
+ */
+static int
+pg_get_client_port_range(void)
+{
+	int		port;
+
+	if (MyProcPort == NULL || MyProcPort->remote_port == NULL)
+		return -1;
+
+	port = atoi(MyProcPort->remote_port);
+	if (port <= 0)
+		return -1;
+	return port - port % PGSM_AGG_PORT_RANGE;
+}
+
+/*
+ * Build an inet datum from a client address as kept by pg_get_client_addr().
+ */
+static Datum
+client_ip_datum(uint host)
+{
+	inet	*res = (inet *) palloc0(sizeof(inet));
+	uint32	addr = htonl(host);
+
+	ip_family(res) = PGSQL_AF_INET;
+	ip_bits(res) = 32;
+	memcpy(ip_addr(res), &addr, sizeof(addr));
+	SET_INET_VARSIZE(res);
+	return InetPGetDatum(res);
+}
+
+/*
+ * Confine a query string to the statement at query_location, as pgss_store
+ * records it, and return its start.  query_location and query_len are
+ * adjusted accordingly.
+ */
+static const char *
+query_extent(const char *query, int *query_location, int *query_len)
+{
+	/*
+	 * Confine our attention to the relevant part of the string, if the query
+	 * is a portion of a multi-statement source string.
+	 *
+	 * First apply starting offset, unless it's -1 (unknown).
+	 */
+	if (*query_location >= 0)
+	{
+		Assert(*query_location <= strlen(query));
+		query += *query_location;
+		/* Length of 0 (or -1) means "rest of string" */
+		if (*query_len <= 0)
+			*query_len = strlen(query);
+		else
+			Assert(*query_len <= strlen(query));
+	}
+	else
+	{
+		/* If query location is unknown, distrust query_len as well */
+		*query_location = 0;
+		*query_len = strlen(query);
+	}
+
+	/*
+	 * Discard leading and trailing whitespace, too.  Use scanner_isspace()
+	 * not libc's isspace(), because we want to match the lexer's behavior.
+	 */
+	while (*query_len > 0 && scanner_isspace(query[0]))
+		query++, (*query_location)++, (*query_len)--;
+	while (*query_len > 0 && scanner_isspace(query[*query_len - 1]))
+		(*query_len)--;
+
+	return query;
+}
+
 /*
  * Store some statistics for a statement.
  *
@@ -817,71 +1382,53 @@ pg_get_client_addr(void)
  * If jstate is not NULL then we're trying to create an entry for which
  * we have no statistics as yet; we just want to record the normalized
  * query string.  total_time, rows, bufusage are ignored in this case.
+ *
+ * weight is the number of executions this one stands for when statements
+ * are sampled; additive counters are scaled by it, while min/max/mean are
+ * computed over the recorded samples only.
+ *
+ * plan_kind tells whether an execution used a generic or a custom plan from
+ * the plan cache, replan_time being the time spent building a custom one.
  */
 static void pgss_store(const char *query, uint64 queryId,
 				int query_location, int query_len,
 				bool kind,
 				double total_time, uint64 rows,
+				double weight,
 				const BufferUsage *bufusage,
 #if PG_VERSION_NUM >= 130000
 				const WalUsage *walusage,
 #endif
 				pgssJumbleState *jstate,
-				float utime, float stime)
+				float utime, float stime,
+				pgssPlanKind plan_kind, double replan_time)
 {
 	pgssHashKey		key;
 	pgssEntry		*entry;
 	char			*norm_query = NULL;
 	int				encoding = GetDatabaseEncoding();
 	bool			reset = false;
+	bool			text_found;
+	bool			exclusive = false;
+	uint			host;
 	int				i;
 	char			tables_name[MAX_REL_LEN] = {0};
 
 	Assert(query != NULL);
 
 	/* Safety check... */
-	if (!IsHashInitialize() || !pgss_qbuf[pgss->current_wbucket])
+	if (!IsHashInitialize() || !pgss_qbuf)
 		return;
 
+	query = query_extent(query, &query_location, &query_len);
+
 	/*
-	 * Confine our attention to the relevant part of the string, if the query
-	 * is a portion of a multi-statement source string.
-	 *
-	 * First apply starting offset, unless it's -1 (unknown).
+	 * For utility statements, we just hash the query string to get an ID.
 	 */
-	if (query_location >= 0)
-	{
-		Assert(query_location <= strlen(query));
-		query += query_location;
-		/* Length of 0 (or -1) means "rest of string" */
-		if (query_len <= 0)
-			query_len = strlen(query);
-		else
-			Assert(query_len <= strlen(query));
-	}
-	else
-	{
-		/* If query location is unknown, distrust query_len as well */
-		query_location = 0;
-		query_len = strlen(query);
-	}
-
-	/*
-	 * Discard leading and trailing whitespace, too.  Use scanner_isspace()
-	 * not libc's isspace(), because we want to match the lexer's behavior.
-	 */
-	while (query_len > 0 && scanner_isspace(query[0]))
-		query++, query_location++, query_len--;
-	while (query_len > 0 && scanner_isspace(query[query_len - 1]))
-		query_len--;
-
-	/*
-	 * For utility statements, we just hash the query string to get an ID.
-	 */
-	if (queryId == UINT64CONST(0))
-		queryId = pgss_hash_string(query, query_len);
-
-
+	if (queryId == UINT64CONST(0))
+		queryId = pgss_hash_string(query, query_len);
+
+
 	{
 		pgssObjectHashKey		key;
 		pgssObjectEntry			*entry;
@@ -900,6 +1447,8 @@ static void pgss_store(const char *query, uint64 queryId,
 		LWLockRelease(pgss->lock);
 	}
 
+	host = pg_get_client_addr();
+
 	/* Set up key for hashtable search */
 	key.userid = GetUserId();
 	key.dbid = MyDatabaseId;
@@ -912,10 +1461,14 @@ static void pgss_store(const char *query, uint64 queryId,
 		pgss->current_wbucket = key.bucket_id;
 	}
 
-	/* Lookup the hash table entry with shared lock. */
+	/*
+	 * Lookup the hash table entry with shared lock.  The common case of a
+	 * known query whose text is already stored needs nothing more.
+	 */
 	LWLockAcquire(pgss->lock, LW_SHARED);
 	entry = (pgssEntry *) hash_search(pgss_hash, &key, HASH_FIND, NULL);
-	if(!entry)
+	text_found = query_text_ref(key.bucket_id, PGSS_TEXT_QUERY, queryId);
+	if (!entry || !text_found)
 	{
 		/*
 		 * Create a new, normalized query string if caller asked.  We don't
@@ -924,29 +1477,28 @@ static void pgss_store(const char *query, uint64 queryId,
 		 * in the interval where we don't hold the lock below.  That case is
 		 * handled by entry_alloc.)
 		 */
-		if (jstate)
-		{
-			LWLockRelease(pgss->lock);
+		LWLockRelease(pgss->lock);
+		if (jstate && !text_found)
 			norm_query = generate_normalized_query(jstate, query,
 												   query_location,
 												   &query_len,
 												   encoding);
-			LWLockAcquire(pgss->lock, LW_SHARED);
-		}
-
-		LWLockRelease(pgss->lock);
 		LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+		exclusive = true;
 
 		/* OK to create a new hashtable entry */
 		entry = entry_alloc(pgss, &key, 0, query_len, encoding, jstate != NULL);
 		if (entry == NULL)
 			goto exit;
-	}
 
-	if (PGSM_NORMALIZED_QUERY)
-		store_query(queryId, norm_query ? norm_query : query, query_len);
-	else
-		store_query(queryId, query, query_len);
+		if (!text_found)
+		{
+			if (PGSM_NORMALIZED_QUERY)
+				store_query(key.bucket_id, PGSS_TEXT_QUERY, queryId, norm_query ? norm_query : query, query_len);
+			else
+				store_query(key.bucket_id, PGSS_TEXT_QUERY, queryId, query, query_len);
+		}
+	}
 
 	/*
 	 * Grab the spinlock while updating the counters (see comment about
@@ -964,16 +1516,12 @@ static void pgss_store(const char *query, uint64 queryId,
 			if (reset)
 				memset(&entry->counters, 0, sizeof(Counters));
 
-			/* Calculate the agregates for database/user and host */
-			update_agg_counters(entry->key.bucket_id, key.queryid, key.dbid, AGG_KEY_DATABASE);
-			update_agg_counters(entry->key.bucket_id, key.queryid, key.userid, AGG_KEY_USER);
-			update_agg_counters(entry->key.bucket_id, key.queryid, pg_get_client_addr(), AGG_KEY_HOST);
-
 		/* "Unstick" entry if it was previously sticky */
 		if (e->counters.calls[kind].calls == 0)
 			e->counters.calls[kind].usage = USAGE_INIT;
 		e->counters.calls[kind].calls += 1;
-		e->counters.time[kind].total_time += total_time;
+		e->counters.calls[kind].est_calls += weight;
+		e->counters.time[kind].total_time += total_time * weight;
 
 		if (e->counters.calls[kind].calls == 1)
 		{
@@ -1001,32 +1549,32 @@ static void pgss_store(const char *query, uint64 queryId,
 				e->counters.time[kind].max_time = total_time;
 		}
 
-		for (i = 0; i < MAX_RESPONSE_BUCKET - 1; i++)
+		i = get_resp_bucket(total_time);
+		if (i >= 0)
+			pgssBucketEntries[entry->key.bucket_id]->counters.resp_calls[i]++;
+
+		e->counters.calls[kind].rows += SAMPLE_SCALE(rows, weight);
+		e->counters.blocks.shared_blks_hit += SAMPLE_SCALE(bufusage->shared_blks_hit, weight);
+		e->counters.blocks.shared_blks_read += SAMPLE_SCALE(bufusage->shared_blks_read, weight);
+		e->counters.blocks.shared_blks_dirtied += SAMPLE_SCALE(bufusage->shared_blks_dirtied, weight);
+		e->counters.blocks.shared_blks_written += SAMPLE_SCALE(bufusage->shared_blks_written, weight);
+		e->counters.blocks.local_blks_hit += SAMPLE_SCALE(bufusage->local_blks_hit, weight);
+		e->counters.blocks.local_blks_read += SAMPLE_SCALE(bufusage->local_blks_read, weight);
+		e->counters.blocks.local_blks_dirtied += SAMPLE_SCALE(bufusage->local_blks_dirtied, weight);
+		e->counters.blocks.local_blks_written += SAMPLE_SCALE(bufusage->local_blks_written, weight);
+		e->counters.blocks.temp_blks_read += SAMPLE_SCALE(bufusage->temp_blks_read, weight);
+		e->counters.blocks.temp_blks_written += SAMPLE_SCALE(bufusage->temp_blks_written, weight);
+		e->counters.blocks.blk_read_time += INSTR_TIME_GET_MILLISEC(bufusage->blk_read_time) * weight;
+		e->counters.blocks.blk_write_time += INSTR_TIME_GET_MILLISEC(bufusage->blk_write_time) * weight;
+		e->counters.calls[kind].usage += USAGE_EXEC(total_time);
+		if (plan_kind == PGSM_PLAN_GENERIC)
+			e->counters.plancache.generic_calls += weight;
+		else if (plan_kind == PGSM_PLAN_CUSTOM)
 		{
-			if (total_time < PGSM_RESPOSE_TIME_LOWER_BOUND + (PGSM_RESPOSE_TIME_STEP * i))
-			{
-				pgssBucketEntries[entry->key.bucket_id]->counters.resp_calls[i]++;
-				break;
-			}
+			e->counters.plancache.custom_calls += weight;
+			e->counters.plancache.replan_time += replan_time * weight;
 		}
-		if (total_time > PGSM_RESPOSE_TIME_LOWER_BOUND + (PGSM_RESPOSE_TIME_STEP * MAX_RESPONSE_BUCKET))
-			pgssBucketEntries[entry->key.bucket_id]->counters.resp_calls[MAX_RESPONSE_BUCKET - 1]++;
-
-		e->counters.calls[kind].rows += rows;
-		e->counters.blocks.shared_blks_hit += bufusage->shared_blks_hit;
-		e->counters.blocks.shared_blks_read += bufusage->shared_blks_read;
-		e->counters.blocks.shared_blks_dirtied += bufusage->shared_blks_dirtied;
-		e->counters.blocks.shared_blks_written += bufusage->shared_blks_written;
-		e->counters.blocks.local_blks_hit += bufusage->local_blks_hit;
-		e->counters.blocks.local_blks_read += bufusage->local_blks_read;
-		e->counters.blocks.local_blks_dirtied += bufusage->local_blks_dirtied;
-		e->counters.blocks.local_blks_written += bufusage->local_blks_written;
-		e->counters.blocks.temp_blks_read += bufusage->temp_blks_read;
-		e->counters.blocks.temp_blks_written += bufusage->temp_blks_written;
-		e->counters.blocks.blk_read_time += INSTR_TIME_GET_MILLISEC(bufusage->blk_read_time);
-		e->counters.blocks.blk_write_time += INSTR_TIME_GET_MILLISEC(bufusage->blk_write_time);
-		e->counters.calls[kind].usage += USAGE_EXEC(total_time);
-		e->counters.info.host = pg_get_client_addr();
+		e->counters.info.host = host;
 		e->counters.sysinfo.utime = utime;
 		e->counters.sysinfo.stime = stime;
 		for(i = 0; i < MAX_REL_LEN - 1; i++)
@@ -1035,10 +1583,27 @@ static void pgss_store(const char *query, uint64 queryId,
 		}
 	}
 
+	/* Calculate the agregates for the enabled dimensions, executions only */
+	if (!jstate && kind == PGSS_EXEC && pgsm_agg_dimensions != 0)
+	{
+		/* New aggregate entries need the exclusive lock */
+		if (!update_agg_counters(key.bucket_id, key.queryid, key.userid, key.dbid, host,
+								 total_time, rows, weight, bufusage, utime, stime,
+								 exclusive))
+		{
+			LWLockRelease(pgss->lock);
+			LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+			update_agg_counters(key.bucket_id, key.queryid, key.userid, key.dbid, host,
+								total_time, rows, weight, bufusage, utime, stime,
+								true);
+		}
+	}
+
 exit:
 	LWLockRelease(pgss->lock);
 
 	/* We postpone this clean-up until we're out of the lock */
+	qtext_flush();
 	if (norm_query)
 		pfree(norm_query);
 }
@@ -1049,15 +1614,17 @@ exit:
 Datum
 pg_stat_monitor_reset(PG_FUNCTION_ARGS)
 {
-	if (!pgss || !pgss_hash || !pgss_agghash || !pgss_buckethash || !pgss_waiteventshash)
+	if (!pgss || !pgss_hash || !pgss_agghash || !pgss_buckethash || !pgssWaitEventEntries)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
+	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
 	entry_dealloc(-1);
+	LWLockRelease(pgss->lock);
 	PG_RETURN_VOID();
 }
 
-#define PG_STAT_STATEMENTS_COLS         38  /* maximum of above */
+#define PG_STAT_STATEMENTS_COLS         49  /* maximum of above */
 
 Datum
 pg_stat_wait_events(PG_FUNCTION_ARGS)
@@ -1067,14 +1634,10 @@ pg_stat_wait_events(PG_FUNCTION_ARGS)
 	Tuplestorestate *tupstore;
 	MemoryContext	per_query_ctx;
 	MemoryContext	oldcontext;
-	HASH_SEQ_STATUS hash_seq;
-	pgssWaitEventEntry		*entry;
-	char			*query_txt;
-	char			queryid_txt[64];
-	query_txt = (char*) malloc(PGSM_QUERY_MAX_LEN);
+	int				n;
 
-	/* hash table must exist already */
-	if (!pgss || !pgss_hash || !pgss_object_hash)
+	/* shared memory must exist already */
+	if (!pgss || !pgssWaitEventEntries)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
@@ -1105,29 +1668,26 @@ pg_stat_wait_events(PG_FUNCTION_ARGS)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	LWLockAcquire(pgss->lock, LW_SHARED);
-
-	hash_seq_init(&hash_seq, pgss_waiteventshash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	for (n = 0; n < MAX_BACKEND_PROCESES; n++)
 	{
+		pgssWaitEventEntry *entry = &pgssWaitEventEntries[n];
 		Datum		values[4];
 		bool		nulls[4] = {true};
 		int			i = 0;
-		int64		queryid = entry->key.queryid;
+		int64		queryid = entry->queryid;
+		uint32		wait_event_info = entry->wait_event_info;
 
-		if (queryid == 0)
+		if (queryid == 0 || entry->pid == 0)
 				continue;
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
 
-		sprintf(queryid_txt, "%08lX", queryid);
-
-		values[i++] = ObjectIdGetDatum(cstring_to_text(queryid_txt));
-		values[i++] = ObjectIdGetDatum(entry->pid);
-		if (entry->wait_event_info != 0)
+		values[i++] = Int64GetDatumFast(queryid);
+		values[i++] = Int64GetDatum((int64) entry->pid);
+		if (wait_event_info != 0)
 		{
-			const char *event_type = pgstat_get_wait_event_type(entry->wait_event_info);
-			const char *event = pgstat_get_wait_event(entry->wait_event_info);
+			const char *event_type = pgstat_get_wait_event_type(wait_event_info);
+			const char *event = pgstat_get_wait_event(wait_event_info);
 			if (event_type)
 				values[i++] = PointerGetDatum(cstring_to_text(event_type));
 			else
@@ -1144,47 +1704,29 @@ pg_stat_wait_events(PG_FUNCTION_ARGS)
 		}
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	free(query_txt);
-
-	/* clean up and return the tuplestore */
-	LWLockRelease(pgss->lock);
 
 	tuplestore_donestoring(tupstore);
 	return (Datum) 0;
 }
 
+#define PG_STAT_WAIT_PROFILE_COLS	6
 
+/*
+ * Return the sampled wait profile of every query.
+ */
 Datum
-pg_stat_monitor(PG_FUNCTION_ARGS)
-{
-	/* If it's really API 1.1, we'll figure that out below */
-	pg_stat_monitor_internal(fcinfo, true);
-	return (Datum) 0;
-}
-
-/* Common code for all versions of pg_stat_statements() */
-static void
-pg_stat_monitor_internal(FunctionCallInfo fcinfo,
-						bool showtext)
+pg_stat_wait_profile(PG_FUNCTION_ARGS)
 {
 	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc		tupdesc;
 	Tuplestorestate *tupstore;
 	MemoryContext	per_query_ctx;
 	MemoryContext	oldcontext;
-	Oid				userid = GetUserId();
-	bool			is_allowed_role = false;
 	HASH_SEQ_STATUS hash_seq;
-	pgssEntry		*entry;
-	char			*query_txt;
-	char			queryid_txt[64];
-	query_txt = (char*) malloc(PGSM_QUERY_MAX_LEN);
-
-	/* Superusers or members of pg_read_all_stats members are allowed */
-	is_allowed_role = is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS);
+	pgssWaitProfileEntry	*entry;
 
 	/* hash table must exist already */
-	if (!pgss || !pgss_hash || !pgss_object_hash)
+	if (!pgss || !pgss_waitprofilehash)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
@@ -1208,6 +1750,9 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "pg_stat_monitor: return type must be a row type");
 
+	if (tupdesc->natts != PG_STAT_WAIT_PROFILE_COLS)
+		elog(ERROR, "pg_stat_monitor: incorrect number of output arguments, required %d", tupdesc->natts);
+
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
 	rsinfo->returnMode = SFRM_Materialize;
 	rsinfo->setResult = tupstore;
@@ -1217,1288 +1762,3185 @@ pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 
 	LWLockAcquire(pgss->lock, LW_SHARED);
 
-	hash_seq_init(&hash_seq, pgss_hash);
+	hash_seq_init(&hash_seq, pgss_waitprofilehash);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		Datum		values[PG_STAT_STATEMENTS_COLS];
-		bool		nulls[PG_STAT_STATEMENTS_COLS];
+		Datum		values[PG_STAT_WAIT_PROFILE_COLS];
+		bool		nulls[PG_STAT_WAIT_PROFILE_COLS];
 		int			i = 0;
-		Counters	tmp;
-		double		stddev;
-		int64		queryid = entry->key.queryid;
+		uint32		wait_event_info = entry->key.wait_event_info;
+		const char	*event_type = NULL;
+		const char	*event = NULL;
 
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
 
-		if(locate_query(entry->key.bucket_id, queryid, query_txt) == 0)
-			sprintf(query_txt, "%s", "<invalid query text, probably no space left in shared buffer>");
-
-		sprintf(queryid_txt, "%08lX", queryid);
-
-		values[i++] = ObjectIdGetDatum(entry->key.bucket_id);
-		values[i++] = ObjectIdGetDatum(entry->key.userid);
-		values[i++] = ObjectIdGetDatum(entry->key.dbid);
-		/* copy counters to a local variable to keep locking time short */
-		{
-			volatile pgssEntry *e = (volatile pgssEntry *) entry;
-			SpinLockAcquire(&e->mutex);
-			tmp = e->counters;
-			SpinLockRelease(&e->mutex);
-		}
-		if (is_allowed_role || entry->key.userid == userid)
-		{
-			values[i++] = CStringGetTextDatum(queryid_txt);
-			if (showtext)
-			{
-					char	*enc;
-					enc = pg_any_to_server(query_txt, strlen(query_txt), entry->encoding);
-					values[i++] = CStringGetTextDatum(enc);
-					if (enc != query_txt)
-						pfree(enc);
-			}
-		    else
-			{
-				/* Query text not requested */
-				nulls[i++] = true;
-			}
-		}
-		else
+		if (wait_event_info != 0)
 		{
-			/*
-			 * Don't show query text, but hint as to the reason for not doing
-			 *	so if it was requested
-			 */
-			if (showtext)
-				values[i++] = CStringGetTextDatum("<insufficient privilege>");
-			else
-				nulls[i++] = true;
+			event_type = pgstat_get_wait_event_type(wait_event_info);
+			event = pgstat_get_wait_event(wait_event_info);
 		}
 
-		values[i++] = TimestampGetDatum(pgssBucketEntries[entry->key.bucket_id]->counters.current_time);
-
-		for (int kind = 0; kind < PGSS_NUMKIND; kind++)
-		{
-			values[i++] = Int64GetDatumFast(tmp.calls[kind].calls);
-			values[i++] = Float8GetDatumFast(tmp.time[kind].total_time);
-			values[i++] = Float8GetDatumFast(tmp.time[kind].min_time);
-			values[i++] = Float8GetDatumFast(tmp.time[kind].max_time);
-			values[i++] = Float8GetDatumFast(tmp.time[kind].mean_time);
-			if (tmp.calls[kind].calls > 1)
-				stddev = sqrt(tmp.time[kind].sum_var_time / tmp.calls[kind].calls);
-			else
-				stddev = 0.0;
-			values[i++] = Float8GetDatumFast(stddev);
-			values[i++] = Int64GetDatumFast(tmp.calls[kind].rows);
-		}
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_hit);
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_dirtied);
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_written);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_hit);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_dirtied);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_written);
-		values[i++] = Int64GetDatumFast(tmp.blocks.temp_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.blocks.temp_blks_written);
-		values[i++] = Float8GetDatumFast(tmp.blocks.blk_read_time);
-		values[i++] = Float8GetDatumFast(tmp.blocks.blk_write_time);
-		values[i++] = Int64GetDatumFast(tmp.info.host);
-		values[i++] = ArrayGetTextDatum(pgssBucketEntries[entry->key.bucket_id]->counters.resp_calls);
-		values[i++] = Float8GetDatumFast(tmp.sysinfo.utime);
-		values[i++] = Float8GetDatumFast(tmp.sysinfo.stime);
-		if (strlen(tmp.info.tables_name) == 0)
+		values[i++] = Int32GetDatum((int32) entry->key.bucket_id);
+		values[i++] = Int64GetDatum((int64) entry->key.queryid);
+		if (event_type)
+			values[i++] = CStringGetTextDatum(event_type);
+		else
 			nulls[i++] = true;
+		if (event)
+			values[i++] = CStringGetTextDatum(event);
 		else
-			values[i++] = CStringGetTextDatum(tmp.info.tables_name);
+			nulls[i++] = true;
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->samples));
+		values[i++] = Float8GetDatum(pg_atomic_read_u64(&entry->time) / 1000.0);
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	free(query_txt);
 
 	/* clean up and return the tuplestore */
 	LWLockRelease(pgss->lock);
 
 	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
 }
+#define PG_STAT_WAIT_SAMPLER_COLS	5
 
 /*
- * Estimate shared memory space needed.
+ * Return the state of the wait event collectors.
  */
-static Size
-pgss_memsize(void)
+Datum
+pg_stat_wait_sampler(PG_FUNCTION_ARGS)
 {
-	Size	size;
-
-	size = MAXALIGN(sizeof(pgssSharedState));
-	size = add_size(size, hash_estimate_size(PGSM_MAX, sizeof(pgssEntry)));
-
-	return size;
-}
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	int				n;
 
-/*
- * Allocate a new hashtable entry.
- * caller must hold an exclusive lock on pgss->lock
- *
- * "query" need not be null-terminated; we rely on query_len instead
- *
- * If "sticky" is true, make the new entry artificially sticky so that it will
- * probably still be there when the query finishes execution.  We do this by
- * giving it a median usage value rather than the normal value.  (Strictly
- * speaking, query strings are normalized on a best effort basis, though it
- * would be difficult to demonstrate this even under artificial conditions.)
- *
- * Note: despite needing exclusive lock, it's not an error for the target
- * entry to already exist.  This is because pgss_store releases and
- * reacquires lock after failing to find a match; so someone else could
- * have made the entry while we waited to get exclusive lock.
- */
-static pgssEntry *
-entry_alloc(pgssSharedState *pgss, pgssHashKey *key, Size query_offset, int query_len, int encoding,
-			bool sticky)
-{
-	pgssEntry	*entry = NULL;
-	bool		found = false;
+	if (!pgss)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
 
-	if (pgss->bucket_entry[pgss->current_wbucket] >= (PGSM_MAX / PGSM_MAX_BUCKETS))
-	{
-		pgss->bucket_overflow[pgss->current_wbucket]++;
-		return NULL;
-	}
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: set-valued function called in context that cannot accept a set")));
 
-	if (hash_get_num_entries(pgss_hash)  >= PGSM_MAX)
-		return NULL;
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	/* Find or create an entry with desired hash code */
-	entry = (pgssEntry *) hash_search(pgss_hash, key, HASH_ENTER, &found);
-	if (!found)
-	{
-		pgss->bucket_entry[pgss->current_wbucket]++;
-		/* New entry, initialize it */
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "pg_stat_monitor: return type must be a row type");
 
-		/* reset the statistics */
-		memset(&entry->counters, 0, sizeof(Counters));
-		/* set the appropriate initial usage count */
-		entry->counters.calls[0].usage = sticky ? pgss->cur_median_usage : USAGE_INIT;
-		/* re-initialize the mutex each time ... we assume no one using it */
-		SpinLockInit(&entry->mutex);
-		/* ... and don't forget the query text metadata */
-		entry->encoding = encoding;
-	}
-	return entry;
-}
+	if (tupdesc->natts != PG_STAT_WAIT_SAMPLER_COLS)
+		elog(ERROR, "pg_stat_monitor: incorrect number of output arguments, required %d", tupdesc->natts);
 
-static uint64
-get_next_wbucket(pgssSharedState *pgss)
-{
-	struct timeval	tv;
-	uint64	current_usec;
-	uint64			bucket_id;
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-	gettimeofday(&tv,NULL);
-	current_usec = tv.tv_sec;
+	MemoryContextSwitchTo(oldcontext);
 
-	if ((current_usec - pgss->prev_bucket_usec) > PGSM_BUCKET_TIME)
+	for (n = 0; n < PGSM_WAIT_WORKERS; n++)
 	{
-		bucket_id = pgss->current_wbucket + 1;
-		if (bucket_id == PGSM_MAX_BUCKETS)
-			bucket_id = 0;
+		pgssWaitSampler	sampler;
+		Datum		values[PG_STAT_WAIT_SAMPLER_COLS];
+		bool		nulls[PG_STAT_WAIT_SAMPLER_COLS];
+		int			i = 0;
 
-		LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
-		entry_dealloc(bucket_id);
-		/* reset the query buffer */
-		pgss->query_fifo[bucket_id].head = 0;
-		pgss->query_fifo[bucket_id].tail = 0;
-		LWLockRelease(pgss->lock);
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-		pgss->prev_bucket_usec = current_usec;
+		SpinLockAcquire(&pgss->mutex);
+		sampler = pgss->wait_sampler[n];
+		SpinLockRelease(&pgss->mutex);
 
-		pgssBucketEntries[bucket_id]->counters.current_time = GetCurrentTimestamp();
-		return bucket_id;
+		values[i++] = Int32GetDatum(n);
+		values[i++] = Int32GetDatum(sampler.interval);
+		values[i++] = Int32GetDatum(sampler.active);
+		values[i++] = Float8GetDatum(sampler.sample_rate);
+		values[i++] = Int64GetDatum((int64) sampler.samples);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	return pgss->current_wbucket;
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
 }
+#define PG_STAT_MONITOR_PLANS_COLS	14
 
 /*
- * Deallocate least-used entries.
- *
- * Caller must hold an exclusive lock on pgss->lock.
+ * Return the statistics and the text of every plan of every statement.
  */
-static void
-entry_dealloc(int bucket)
+Datum
+pg_stat_monitor_plans(PG_FUNCTION_ARGS)
 {
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	Oid				userid = GetUserId();
+	bool			is_allowed_role;
 	HASH_SEQ_STATUS hash_seq;
-	HASH_SEQ_STATUS hash_dbseq;
-	pgssEntry		*entry;
-	pgssAggEntry	*agg_entry;
-	pgssEntry		**entries;
-	pgssAggEntry	**agg_entries;
-	int				i;
-	int				nvictims = 0;
+	pgssPlanEntry	*entry;
+	char			*qfile;
+	Size			qfile_size = 0;
 
-	pgss->bucket_entry[bucket] = 0;
+	/* hash table must exist already */
+	if (!pgss || !pgss_planhash || !pgss_texthash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
 
-	entries = palloc(hash_get_num_entries(pgss_hash) * sizeof(pgssEntry *));
-	hash_seq_init(&hash_seq, pgss_hash);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	is_allowed_role = is_member_of_role(userid, DEFAULT_ROLE_READ_ALL_STATS);
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "pg_stat_monitor: return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_MONITOR_PLANS_COLS)
+		elog(ERROR, "pg_stat_monitor: incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgss->lock, LW_SHARED);
+
+	/* Map the query file once, in case some plan texts were spilled to it */
+	qfile = qtext_map(&qfile_size);
+
+	hash_seq_init(&hash_seq, pgss_planhash);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		if (entry->key.bucket_id == bucket || bucket < 0)
-			entries[nvictims++] = entry;
-	}
+		Datum		values[PG_STAT_MONITOR_PLANS_COLS];
+		bool		nulls[PG_STAT_MONITOR_PLANS_COLS];
+		int			i = 0;
+		pgssPlanEntry	tmp;
 
-	for (i = 0; i < nvictims; i++)
-		entry = hash_search(pgss_hash, &entries[i]->key, HASH_REMOVE, NULL);
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-	nvictims = 0;
-	agg_entries = palloc(hash_get_num_entries(pgss_agghash) * sizeof(pgssAggEntry *));
-	hash_seq_init(&hash_dbseq, pgss_agghash);
-	while ((agg_entry = hash_seq_search(&hash_dbseq)) != NULL)
-	{
-		if (agg_entry->key.bucket_id == bucket || bucket < 0)
-			agg_entries[nvictims++] = agg_entry;
+		/* copy counters to a local variable to keep locking time short */
+		{
+			volatile pgssPlanEntry *e = (volatile pgssPlanEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			tmp = *entry;
+			SpinLockRelease(&e->mutex);
+		}
+
+		values[i++] = Int32GetDatum((int32) tmp.key.bucket_id);
+		values[i++] = ObjectIdGetDatum(tmp.key.userid);
+		values[i++] = ObjectIdGetDatum(tmp.key.dbid);
+		if (is_allowed_role || tmp.key.userid == userid)
+		{
+			text	*plan_txt;
+
+			values[i++] = Int64GetDatum((int64) tmp.key.queryid);
+			values[i++] = Int64GetDatum((int64) tmp.key.planid);
+			plan_txt = locate_query(PGSS_TEXT_PLAN,
+									 PLAN_TEXT_ID(tmp.key.queryid, tmp.key.planid),
+									 tmp.encoding, qfile, qfile_size);
+			if (plan_txt == NULL)
+				plan_txt = cstring_to_text("<invalid plan text, probably no space left in shared buffer>");
+			values[i++] = PointerGetDatum(plan_txt);
+		}
+		else
+		{
+			nulls[i++] = true;
+			nulls[i++] = true;
+			values[i++] = CStringGetTextDatum("<insufficient privilege>");
+		}
+		values[i++] = Int64GetDatum((int64) rint(tmp.est_calls));
+		values[i++] = Float8GetDatum(tmp.total_time);
+		values[i++] = Float8GetDatum(tmp.min_time);
+		values[i++] = Float8GetDatum(tmp.max_time);
+		values[i++] = Float8GetDatum(tmp.calls > 0 ? tmp.total_time / tmp.est_calls : 0.0);
+		values[i++] = Int64GetDatum(tmp.rows);
+		values[i++] = TimestampTzGetDatum(tmp.first_seen);
+		values[i++] = TimestampTzGetDatum(tmp.last_seen);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	for (i = 0; i < nvictims; i++)
-		hash_search(pgss_agghash, &agg_entries[i]->key, HASH_REMOVE, NULL);
+	if (qfile)
+		munmap(qfile, qfile_size);
 
-	pfree(entries);
-	pfree(agg_entries);
+	/* clean up and return the tuplestore */
+	LWLockRelease(pgss->lock);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+Datum
+pg_stat_monitor(PG_FUNCTION_ARGS)
+{
+	bool		showtext = PG_GETARG_BOOL(0);
+
+	pg_stat_monitor_internal(fcinfo, showtext);
+	return (Datum) 0;
 }
 
 /*
- * Release all entries.
+ * Return the text of a single query, as identified by the bucket, queryid,
+ * userid and dbid of one of its pg_stat_monitor rows.  The views call this
+ * instead of pg_stat_monitor(true), so that texts are only fetched for the
+ * rows and columns a query actually uses.
+ *
+ * The query file is mapped on the first spilled text and kept across the
+ * rows of the scan, until it is rewritten or has grown past the mapping.
  */
-static void
-entry_reset()
+Datum
+pg_stat_monitor_text(PG_FUNCTION_ARGS)
 {
-	HASH_SEQ_STATUS		hash_seq;
-	pgssEntry			*entry;
-	pgssAggEntry		*dbentry;
-	pgssObjectEntry		*objentry;
-	pgssWaitEventEntry	*weentry;
+	int32		bucket = PG_GETARG_INT32(0);
+	int64		queryid = PG_GETARG_INT64(1);
+	Oid			userid = PG_GETARG_OID(2);
+	Oid			dbid = PG_GETARG_OID(3);
+	pgssHashKey	key;
+	pgssEntry	*entry;
+	pgssTextMap	*map = (pgssTextMap *) fcinfo->flinfo->fn_extra;
+	text		*query_txt = NULL;
 
-	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash || !pgss_texthash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
 
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		hash_search(pgss_hash, &entry->key, HASH_REMOVE, NULL);
-	}
+	/* Same visibility rule as pg_stat_monitor() */
+	if (userid != GetUserId() &&
+		!is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS))
+		PG_RETURN_TEXT_P(cstring_to_text("<insufficient privilege>"));
 
-	hash_seq_init(&hash_seq, pgss_agghash);
-	while ((dbentry = hash_seq_search(&hash_seq)) != NULL)
+	if (bucket < 0 || bucket >= PGSM_MAX_BUCKETS)
+		PG_RETURN_NULL();
+
+	if (map == NULL)
 	{
-		hash_search(pgss_agghash, &dbentry->key, HASH_REMOVE, NULL);
+		map = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(pgssTextMap));
+		map->cleanup.func = text_map_release;
+		map->cleanup.arg = map;
+		MemoryContextRegisterResetCallback(fcinfo->flinfo->fn_mcxt, &map->cleanup);
+		fcinfo->flinfo->fn_extra = map;
 	}
 
-	hash_seq_init(&hash_seq, pgss_buckethash);
-    while ((objentry = hash_seq_search(&hash_seq)) != NULL)
-    {
-		hash_search(pgss_buckethash, &dbentry->key, HASH_REMOVE, NULL);
-    }
-
-	hash_seq_init(&hash_seq, pgss_waiteventshash);
-	while ((weentry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		hash_search(pgss_waiteventshash, &dbentry->key, HASH_REMOVE, NULL);
-    }
-	pgss->current_wbucket = 0;
-	free(pgssWaitEventEntries);
-    free(pgssBucketEntries);
-	LWLockRelease(pgss->lock);
-}
+	key.bucket_id = bucket;
+	key.queryid = (uint64) queryid;
+	key.userid = userid;
+	key.dbid = dbid;
 
-/*
- * AppendJumble: Append a value that is substantive in a given query to
- * the current jumble.
- */
-static void
-AppendJumble(pgssJumbleState *jstate, const unsigned char *item, Size size)
-{
-	unsigned char *jumble = jstate->jumble;
-	Size		jumble_len = jstate->jumble_len;
+	LWLockAcquire(pgss->lock, LW_SHARED);
 
-	/*
-	 * Whenever the jumble buffer is full, we hash the current contents and
-	 * reset the buffer to contain just that hash value, thus relying on the
-	 * hash to summarize everything so far.
-	 */
-	while (size > 0)
+	entry = (pgssEntry *) hash_search(pgss_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
 	{
-		Size		part_size;
+		query_txt = locate_query(PGSS_TEXT_QUERY, key.queryid, entry->encoding, map->qfile, map->size);
 
-		if (jumble_len >= JUMBLE_SIZE)
+		/* The text may be in a part of the query file we have not mapped */
+		if (query_txt == NULL)
 		{
-			uint64		start_hash;
+			uint32	generation;
+			Size	extent;
 
-			start_hash = DatumGetUInt64(hash_any_extended(jumble,
-														  JUMBLE_SIZE, 0));
-			memcpy(jumble, &start_hash, sizeof(start_hash));
-			jumble_len = sizeof(start_hash);
+			SpinLockAcquire(&pgss->mutex);
+			generation = pgss->qfile_generation;
+			extent = pgss->extent;
+			SpinLockRelease(&pgss->mutex);
+
+			if (map->qfile == NULL || map->generation != generation ||
+				map->size < extent)
+			{
+				text_map_release(map);
+				map->qfile = qtext_map(&map->size);
+				map->generation = generation;
+				query_txt = locate_query(PGSS_TEXT_QUERY, key.queryid, entry->encoding, map->qfile, map->size);
+			}
 		}
-		part_size = Min(size, JUMBLE_SIZE - jumble_len);
-		memcpy(jumble + jumble_len, item, part_size);
-		jumble_len += part_size;
-		item += part_size;
-		size -= part_size;
+		if (query_txt == NULL)
+			query_txt = cstring_to_text("<invalid query text, probably no space left in shared buffer>");
 	}
-	jstate->jumble_len = jumble_len;
-}
 
-/*
- * Wrappers around AppendJumble to encapsulate details of serialization
- * of individual local variable elements.
- */
-#define APP_JUMB(item) \
-	AppendJumble(jstate, (const unsigned char *) &(item), sizeof(item))
-#define APP_JUMB_STRING(str) \
-	AppendJumble(jstate, (const unsigned char *) (str), strlen(str) + 1)
+	LWLockRelease(pgss->lock);
+
+	if (query_txt == NULL)
+		PG_RETURN_NULL();
+	PG_RETURN_TEXT_P(query_txt);
+}
 
 /*
- * JumbleQuery: Selectively serialize the query tree, appending significant
- * data to the "query jumble" while ignoring nonsignificant data.
- *
- * Rule of thumb for what to include is that we should ignore anything not
- * semantically significant (such as alias names) as well as anything that can
- * be deduced from child nodes (else we'd just be double-hashing that piece
- * of information).
+ * Unmap the query file mapped by pg_stat_monitor_text().
  */
 static void
-JumbleQuery(pgssJumbleState *jstate, Query *query)
+text_map_release(void *arg)
 {
-	Assert(IsA(query, Query));
-	Assert(query->utilityStmt == NULL);
+	pgssTextMap	*map = (pgssTextMap *) arg;
 
-	APP_JUMB(query->commandType);
-	/* resultRelation is usually predictable from commandType */
-	JumbleExpr(jstate, (Node *) query->cteList);
-	JumbleRangeTable(jstate, query->rtable);
-	JumbleExpr(jstate, (Node *) query->jointree);
-	JumbleExpr(jstate, (Node *) query->targetList);
-	JumbleExpr(jstate, (Node *) query->onConflict);
-	JumbleExpr(jstate, (Node *) query->returningList);
-	JumbleExpr(jstate, (Node *) query->groupClause);
-	JumbleExpr(jstate, (Node *) query->groupingSets);
-	JumbleExpr(jstate, query->havingQual);
-	JumbleExpr(jstate, (Node *) query->windowClause);
-	JumbleExpr(jstate, (Node *) query->distinctClause);
-	JumbleExpr(jstate, (Node *) query->sortClause);
-	JumbleExpr(jstate, query->limitOffset);
-	JumbleExpr(jstate, query->limitCount);
-	/* we ignore rowMarks */
-	JumbleExpr(jstate, query->setOperations);
+	if (map->qfile)
+		munmap(map->qfile, map->size);
+	map->qfile = NULL;
+	map->size = 0;
 }
 
-/*
- * Jumble a range table
- */
+/* Common code for all versions of pg_stat_statements() */
 static void
-JumbleRangeTable(pgssJumbleState *jstate, List *rtable)
+pg_stat_monitor_internal(FunctionCallInfo fcinfo,
+						bool showtext)
 {
-	ListCell   *lc;
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	Oid				userid = GetUserId();
+	bool			is_allowed_role = false;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry		*entry;
+	char			*qfile;
+	Size			qfile_size = 0;
 
-	foreach(lc, rtable)
-	{
-		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	is_allowed_role = is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS);
 
-		APP_JUMB(rte->rtekind);
-		switch (rte->rtekind)
-		{
-			case RTE_RELATION:
-				APP_JUMB(rte->relid);
-				JumbleExpr(jstate, (Node *) rte->tablesample);
-				break;
-			case RTE_SUBQUERY:
-				JumbleQuery(jstate, rte->subquery);
-				break;
-			case RTE_JOIN:
-				APP_JUMB(rte->jointype);
-				break;
-			case RTE_FUNCTION:
-				JumbleExpr(jstate, (Node *) rte->functions);
-				break;
-			case RTE_TABLEFUNC:
-				JumbleExpr(jstate, (Node *) rte->tablefunc);
-				break;
-			case RTE_VALUES:
-				JumbleExpr(jstate, (Node *) rte->values_lists);
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash || !pgss_object_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "pg_stat_monitor: return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgss->lock, LW_SHARED);
+
+	/* Spilled texts cannot be compacted away while we hold the lock */
+	qfile = showtext ? qtext_map(&qfile_size) : NULL;
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PG_STAT_STATEMENTS_COLS];
+		bool		nulls[PG_STAT_STATEMENTS_COLS];
+		int			i = 0;
+		Counters	tmp;
+		double		stddev;
+		int64		queryid = entry->key.queryid;
+		text		*query_txt = NULL;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(entry->key.bucket_id);
+		values[i++] = ObjectIdGetDatum(entry->key.userid);
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		/* copy counters to a local variable to keep locking time short */
+		{
+			volatile pgssEntry *e = (volatile pgssEntry *) entry;
+			SpinLockAcquire(&e->mutex);
+			tmp = e->counters;
+			SpinLockRelease(&e->mutex);
+		}
+		if (is_allowed_role || entry->key.userid == userid)
+		{
+			values[i++] = Int64GetDatumFast(queryid);
+			if (showtext)
+			{
+				query_txt = locate_query(PGSS_TEXT_QUERY, queryid, entry->encoding, qfile, qfile_size);
+				if (query_txt == NULL)
+					query_txt = cstring_to_text("<invalid query text, probably no space left in shared buffer>");
+				values[i++] = PointerGetDatum(query_txt);
+			}
+		    else
+			{
+				/* Query text not requested */
+				nulls[i++] = true;
+			}
+		}
+		else
+		{
+			/* Nor the queryid */
+			nulls[i++] = true;
+
+			/*
+			 * Don't show query text, but hint as to the reason for not doing
+			 *	so if it was requested
+			 */
+			if (showtext)
+				values[i++] = CStringGetTextDatum("<insufficient privilege>");
+			else
+				nulls[i++] = true;
+		}
+
+		if (tmp.info.planid != 0)
+			values[i++] = Int64GetDatum((int64) tmp.info.planid);
+		else
+			nulls[i++] = true;
+		values[i++] = TimestampGetDatum(pgssBucketEntries[entry->key.bucket_id]->counters.current_time);
+
+		for (int kind = 0; kind < PGSS_NUMKIND; kind++)
+		{
+			values[i++] = Int64GetDatum((int64) rint(tmp.calls[kind].est_calls));
+			values[i++] = Float8GetDatumFast(tmp.time[kind].total_time);
+			values[i++] = Float8GetDatumFast(tmp.time[kind].min_time);
+			values[i++] = Float8GetDatumFast(tmp.time[kind].max_time);
+			values[i++] = Float8GetDatumFast(tmp.time[kind].mean_time);
+			if (tmp.calls[kind].calls > 1)
+				stddev = sqrt(tmp.time[kind].sum_var_time / tmp.calls[kind].calls);
+			else
+				stddev = 0.0;
+			values[i++] = Float8GetDatumFast(stddev);
+			values[i++] = Int64GetDatumFast(tmp.calls[kind].rows);
+		}
+		values[i++] = Int64GetDatumFast(tmp.calls[PGSS_EXEC].calls);
+		values[i++] = Float8GetDatumFast(tmp.topk_error);
+		values[i++] = Int64GetDatum((int64) rint(tmp.plancache.generic_calls));
+		values[i++] = Int64GetDatum((int64) rint(tmp.plancache.custom_calls));
+		values[i++] = Float8GetDatumFast(tmp.plancache.replan_time);
+		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_hit);
+		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_read);
+		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_dirtied);
+		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_written);
+		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_hit);
+		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_read);
+		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_dirtied);
+		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_written);
+		values[i++] = Int64GetDatumFast(tmp.blocks.temp_blks_read);
+		values[i++] = Int64GetDatumFast(tmp.blocks.temp_blks_written);
+		values[i++] = Float8GetDatumFast(tmp.blocks.blk_read_time);
+		values[i++] = Float8GetDatumFast(tmp.blocks.blk_write_time);
+		values[i++] = Int64GetDatum((int64) tmp.info.host);
+		values[i++] = client_ip_datum(tmp.info.host);
+		values[i++] = array_get_datum(pgssBucketEntries[entry->key.bucket_id]->counters.resp_calls);
+		values[i++] = Float8GetDatumFast(tmp.sysinfo.utime);
+		values[i++] = Float8GetDatumFast(tmp.sysinfo.stime);
+		values[i++] = Float8GetDatumFast(tmp.wait.lock_time);
+		values[i++] = Float8GetDatumFast(tmp.wait.lwlock_time);
+		values[i++] = Float8GetDatumFast(tmp.wait.io_time);
+		values[i++] = Float8GetDatumFast(tmp.wait.ipc_time);
+		values[i++] = Float8GetDatumFast(tmp.wait.client_time);
+		if (strlen(tmp.info.tables_name) == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(tmp.info.tables_name);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		if (query_txt)
+			pfree(query_txt);
+	}
+	if (qfile)
+		munmap(qfile, qfile_size);
+
+	/* clean up and return the tuplestore */
+	LWLockRelease(pgss->lock);
+
+	tuplestore_donestoring(tupstore);
+}
+
+/*
+ * Estimate shared memory space needed.
+ */
+static Size
+pgss_memsize(void)
+{
+	Size	size;
+
+	size = MAXALIGN(sizeof(pgssSharedState));
+	size = add_size(size, hash_estimate_size(PGSM_MAX, sizeof(pgssEntry)));
+	size = add_size(size, mul_size(sizeof(pgssHeapItem), PGSM_MAX));
+	size = add_size(size, PGSM_QUERY_BUF_SIZE);
+	size = add_size(size, hash_estimate_size(PGSM_TEXT_MAX, sizeof(pgssTextEntry)));
+	size = add_size(size, hash_estimate_size(agg_capacity(), sizeof(pgssAggEntry)));
+	size = add_size(size, mul_size(sizeof(pgssHeapItem), agg_capacity()));
+	size = add_size(size, hash_estimate_size(PGSM_MAX, sizeof(pgssWaitProfileEntry)));
+	size = add_size(size, hash_estimate_size(PGSM_MAX, sizeof(pgssPlanEntry)));
+	size = add_size(size, mul_size(sizeof(pgssWaitEventEntry), MAX_BACKEND_PROCESES));
+
+	return size;
+}
+
+/*
+ * Allocate a new hashtable entry.
+ * caller must hold an exclusive lock on pgss->lock
+ *
+ * "query" need not be null-terminated; we rely on query_len instead
+ *
+ * If "sticky" is true, make the new entry artificially sticky so that it will
+ * probably still be there when the query finishes execution.  We do this by
+ * giving it a median usage value rather than the normal value.  (Strictly
+ * speaking, query strings are normalized on a best effort basis, though it
+ * would be difficult to demonstrate this even under artificial conditions.)
+ *
+ * Note: despite needing exclusive lock, it's not an error for the target
+ * entry to already exist.  This is because pgss_store releases and
+ * reacquires lock after failing to find a match; so someone else could
+ * have made the entry while we waited to get exclusive lock.
+ */
+static pgssEntry *
+entry_alloc(pgssSharedState *pgss, pgssHashKey *key, Size query_offset, int query_len, int encoding,
+			bool sticky)
+{
+	pgssEntry	*entry = NULL;
+	bool		found = false;
+	double		topk_error = 0;
+
+	if (pgss->bucket_entry[pgss->current_wbucket] >= (PGSM_MAX / PGSM_MAX_BUCKETS) ||
+		hash_get_num_entries(pgss_hash) >= PGSM_MAX)
+	{
+		pgssEntry	*victim;
+
+		/* Someone else may have made the entry while we waited for the lock */
+		entry = (pgssEntry *) hash_search(pgss_hash, key, HASH_FIND, NULL);
+		if (entry)
+			return entry;
+
+		/*
+		 * In top-K mode the new query takes the place of the lightest entry
+		 * of the bucket and inherits its weight as error.
+		 *
+		 * This is the Space-Saving algorithm with the bucket's entries as
+		 * counters: the weight of every entry over-estimates its true value
+		 * by at most topk_error, which in turn is never more than total /
+		 * entries.  Any query above that share of the bucket's calls (or
+		 * time) is guaranteed to be kept.
+		 */
+		victim = (PGSM_TOPK == PGSM_TOPK_NONE) ? NULL :
+			heap_min(&pgss->topk_heap[key->bucket_id], topk_entry_weight, PGSM_TOPK);
+		if (victim == NULL)
+		{
+			pgss->bucket_overflow[pgss->current_wbucket]++;
+			return NULL;
+		}
+		topk_error = topk_weight(&victim->counters);
+		topk_evict(victim);
+		pgss->bucket_entry[pgss->current_wbucket]--;
+		pgss->bucket_evicted[pgss->current_wbucket]++;
+	}
+
+	/* Find or create an entry with desired hash code */
+	entry = (pgssEntry *) hash_search(pgss_hash, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		pgss->bucket_entry[pgss->current_wbucket]++;
+		/* New entry, initialize it */
+
+		/* reset the statistics */
+		memset(&entry->counters, 0, sizeof(Counters));
+		entry->counters.topk_error = topk_error;
+		/* set the appropriate initial usage count */
+		entry->counters.calls[0].usage = sticky ? pgss->cur_median_usage : USAGE_INIT;
+		/* re-initialize the mutex each time ... we assume no one using it */
+		SpinLockInit(&entry->mutex);
+		/* ... and don't forget the query text metadata */
+		entry->encoding = encoding;
+		heap_push(&pgss->topk_heap[key->bucket_id], entry, topk_weight(&entry->counters));
+	}
+	return entry;
+}
+
+/*
+ * Space-Saving weight of an entry: what it has been charged so far plus the
+ * error inherited from the entry it replaced.
+ */
+static double
+topk_weight(Counters *counters)
+{
+	if (PGSM_TOPK == PGSM_TOPK_TIME)
+		return counters->time[PGSS_EXEC].total_time + counters->topk_error;
+	return counters->calls[PGSS_EXEC].est_calls + counters->topk_error;
+}
+
+static double
+topk_entry_weight(void *entry)
+{
+	return topk_weight(&((pgssEntry *) entry)->counters);
+}
+
+/*
+ * Remove a top-K victim, with its plans.  Its wait profile and its
+ * references on the texts are shared by the entries of the bucket running
+ * the same query for other users or databases, and go only with the last
+ * of them; otherwise the text store would fill up with the texts of
+ * evicted queries until their bucket expires.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+topk_evict(pgssEntry *victim)
+{
+	pgssHashKey		key = victim->key;
+	HASH_SEQ_STATUS	hash_seq;
+	pgssEntry		*entry;
+	pgssPlanEntry	*plan_entry;
+	pgssWaitProfileEntry *wp_entry;
+	bool			shared = false;
+
+	heap_remove(&pgss->topk_heap[key.bucket_id], victim);
+	hash_search(pgss_hash, &key, HASH_REMOVE, NULL);
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.bucket_id == key.bucket_id && entry->key.queryid == key.queryid)
+		{
+			shared = true;
+			hash_seq_term(&hash_seq);
+			break;
+		}
+	}
+
+	/* Removing the entry being returned is allowed by dynahash */
+	if (hash_get_num_entries(pgss_planhash) > 0)
+	{
+		hash_seq_init(&hash_seq, pgss_planhash);
+		while ((plan_entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (plan_entry->key.bucket_id != key.bucket_id ||
+				plan_entry->key.queryid != key.queryid)
+				continue;
+			if (!shared)
+				query_text_unref(key.bucket_id, PGSS_TEXT_PLAN,
+								 PLAN_TEXT_ID(key.queryid, plan_entry->key.planid));
+			if (plan_entry->key.userid == key.userid && plan_entry->key.dbid == key.dbid)
+				hash_search(pgss_planhash, &plan_entry->key, HASH_REMOVE, NULL);
+		}
+	}
+
+	if (shared)
+		return;
+
+	hash_seq_init(&hash_seq, pgss_waitprofilehash);
+	while ((wp_entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (wp_entry->key.bucket_id == key.bucket_id && wp_entry->key.queryid == key.queryid)
+			hash_search(pgss_waitprofilehash, &wp_entry->key, HASH_REMOVE, NULL);
+	}
+
+	query_text_unref(key.bucket_id, PGSS_TEXT_QUERY, key.queryid);
+	qtext_gc_if_needed();
+}
+
+/*
+ * Forget the heap of a bucket whose entries were all removed, or of every
+ * bucket if bucket is negative.
+ */
+static void
+topk_heap_reset(int bucket)
+{
+	int		i;
+
+	for (i = 0; i < PGSM_MAX_BUCKETS; i++)
+	{
+		if (bucket < 0 || i == bucket)
+			pgss->topk_heap[i].size = 0;
+	}
+}
+
+#define HEAP_SLOT(heap, entry)	((int *) ((char *) (entry) + (heap)->slot_offset))
+
+static void
+heap_init(pgssHeap *heap, pgssHeapItem *items, int capacity, Size slot_offset)
+{
+	heap->size = 0;
+	heap->capacity = capacity;
+	heap->mode = -1;
+	heap->slot_offset = slot_offset;
+	heap->items = items;
+}
+
+static void
+heap_place(pgssHeap *heap, int i, pgssHeapItem item)
+{
+	heap->items[i] = item;
+	*HEAP_SLOT(heap, item.entry) = i;
+}
+
+static void
+heap_sift_up(pgssHeap *heap, int i)
+{
+	pgssHeapItem	item = heap->items[i];
+
+	while (i > 0)
+	{
+		int		parent = (i - 1) / 2;
+
+		if (heap->items[parent].weight <= item.weight)
+			break;
+		heap_place(heap, i, heap->items[parent]);
+		i = parent;
+	}
+	heap_place(heap, i, item);
+}
+
+static void
+heap_sift_down(pgssHeap *heap, int i)
+{
+	pgssHeapItem	item = heap->items[i];
+
+	for (;;)
+	{
+		int		child = 2 * i + 1;
+
+		if (child >= heap->size)
+			break;
+		if (child + 1 < heap->size &&
+			heap->items[child + 1].weight < heap->items[child].weight)
+			child++;
+		if (item.weight <= heap->items[child].weight)
+			break;
+		heap_place(heap, i, heap->items[child]);
+		i = child;
+	}
+	heap_place(heap, i, item);
+}
+
+/*
+ * Add an entry.  An entry that doesn't fit is never chosen as a victim.
+ */
+static void
+heap_push(pgssHeap *heap, void *entry, double weight)
+{
+	if (heap->size >= heap->capacity)
+	{
+		*HEAP_SLOT(heap, entry) = -1;
+		return;
+	}
+	heap->items[heap->size].entry = entry;
+	heap->items[heap->size].weight = weight;
+	heap_sift_up(heap, heap->size++);
+}
+
+/*
+ * Remove an entry before it is removed from its hash table.
+ */
+static void
+heap_remove(pgssHeap *heap, void *entry)
+{
+	int		i = *HEAP_SLOT(heap, entry);
+
+	if (i < 0 || i >= heap->size || heap->items[i].entry != entry)
+		return;
+	*HEAP_SLOT(heap, entry) = -1;
+	if (i == --heap->size)
+		return;
+
+	heap_place(heap, i, heap->items[heap->size]);
+	if (i > 0 && heap->items[i].weight < heap->items[(i - 1) / 2].weight)
+		heap_sift_up(heap, i);
+	else
+		heap_sift_down(heap, i);
+}
+
+/*
+ * Return the entry with the smallest current weight, without removing it.
+ *
+ * Every weight kept in the heap is a lower bound of the entry's current
+ * weight, so once the top one is brought up to date it is the smallest of
+ * all.  Each refresh is paid for by updates made since the entry was
+ * placed, which keeps the cost amortized O(log n).  mode tells what the
+ * weights measure; when it changes they are all recomputed.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void *
+heap_min(pgssHeap *heap, pgssHeapWeight weight, int mode)
+{
+	int		i;
+
+	if (heap->size == 0)
+		return NULL;
+
+	if (heap->mode != mode)
+	{
+		for (i = 0; i < heap->size; i++)
+			heap->items[i].weight = weight(heap->items[i].entry);
+		for (i = heap->size / 2 - 1; i >= 0; i--)
+			heap_sift_down(heap, i);
+		heap->mode = mode;
+	}
+
+	for (;;)
+	{
+		pgssHeapItem	*top = &heap->items[0];
+		double			current = weight(top->entry);
+
+		if (current <= top->weight)
+			return top->entry;
+		top->weight = current;
+		heap_sift_down(heap, 0);
+	}
+}
+
+static uint64
+get_next_wbucket(pgssSharedState *pgss)
+{
+	struct timeval	tv;
+	uint64	current_usec;
+	uint64			bucket_id;
+
+	gettimeofday(&tv,NULL);
+	current_usec = tv.tv_sec;
+
+	if ((current_usec - pgss->prev_bucket_usec) > PGSM_BUCKET_TIME)
+	{
+		bucket_id = pgss->current_wbucket + 1;
+		if (bucket_id == PGSM_MAX_BUCKETS)
+			bucket_id = 0;
+
+		LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+		entry_dealloc(bucket_id);
+		LWLockRelease(pgss->lock);
+
+		pgss->prev_bucket_usec = current_usec;
+
+		pgssBucketEntries[bucket_id]->counters.current_time = GetCurrentTimestamp();
+		return bucket_id;
+	}
+	return pgss->current_wbucket;
+}
+
+/*
+ * Deallocate least-used entries.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+entry_dealloc(int bucket)
+{
+	HASH_SEQ_STATUS hash_seq;
+	HASH_SEQ_STATUS hash_dbseq;
+	pgssEntry		*entry;
+	pgssAggEntry	*agg_entry;
+	pgssEntry		**entries;
+	pgssAggEntry	**agg_entries;
+	pgssWaitProfileEntry	*wp_entry;
+	pgssWaitProfileEntry	**wp_entries;
+	pgssPlanEntry	*plan_entry;
+	pgssPlanEntry	**plan_entries;
+	int				i;
+	int				nvictims = 0;
+
+	if (bucket < 0)
+		memset(&pgss->bucket_entry, 0, MAX_BUCKETS * sizeof(uint64));
+	else
+		pgss->bucket_entry[bucket] = 0;
+	topk_heap_reset(bucket);
+
+	entries = palloc(hash_get_num_entries(pgss_hash) * sizeof(pgssEntry *));
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.bucket_id == bucket || bucket < 0)
+			entries[nvictims++] = entry;
+	}
+
+	for (i = 0; i < nvictims; i++)
+		entry = hash_search(pgss_hash, &entries[i]->key, HASH_REMOVE, NULL);
+
+	nvictims = 0;
+	agg_entries = palloc(hash_get_num_entries(pgss_agghash) * sizeof(pgssAggEntry *));
+	hash_seq_init(&hash_dbseq, pgss_agghash);
+	while ((agg_entry = hash_seq_search(&hash_dbseq)) != NULL)
+	{
+		if (agg_entry->key.bucket_id == bucket || bucket < 0)
+			agg_entries[nvictims++] = agg_entry;
+	}
+	for (i = 0; i < nvictims; i++)
+	{
+		pgss->agg_entries[agg_entries[i]->key.type]--;
+		heap_remove(&pgss->agg_heap[agg_entries[i]->key.type], agg_entries[i]);
+		hash_search(pgss_agghash, &agg_entries[i]->key, HASH_REMOVE, NULL);
+	}
+
+	nvictims = 0;
+	wp_entries = palloc(hash_get_num_entries(pgss_waitprofilehash) * sizeof(pgssWaitProfileEntry *));
+	hash_seq_init(&hash_seq, pgss_waitprofilehash);
+	while ((wp_entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (wp_entry->key.bucket_id == bucket || bucket < 0)
+			wp_entries[nvictims++] = wp_entry;
+	}
+	for (i = 0; i < nvictims; i++)
+		hash_search(pgss_waitprofilehash, &wp_entries[i]->key, HASH_REMOVE, NULL);
+
+	nvictims = 0;
+	plan_entries = palloc(hash_get_num_entries(pgss_planhash) * sizeof(pgssPlanEntry *));
+	hash_seq_init(&hash_seq, pgss_planhash);
+	while ((plan_entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (plan_entry->key.bucket_id == bucket || bucket < 0)
+			plan_entries[nvictims++] = plan_entry;
+	}
+	for (i = 0; i < nvictims; i++)
+		hash_search(pgss_planhash, &plan_entries[i]->key, HASH_REMOVE, NULL);
+
+	pfree(entries);
+	pfree(agg_entries);
+	pfree(wp_entries);
+	pfree(plan_entries);
+
+	query_text_release(bucket);
+}
+
+/*
+ * Release all entries.
+ */
+static void
+entry_reset()
+{
+	HASH_SEQ_STATUS		hash_seq;
+	pgssEntry			*entry;
+	pgssAggEntry		*dbentry;
+	pgssObjectEntry		*objentry;
+	pgssWaitProfileEntry *wpentry;
+	pgssPlanEntry		*planentry;
+	int					i;
+
+	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgss_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+	topk_heap_reset(-1);
+
+	hash_seq_init(&hash_seq, pgss_agghash);
+	while ((dbentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgss_agghash, &dbentry->key, HASH_REMOVE, NULL);
+	}
+	memset(&pgss->agg_entries, 0, AGG_KEY_COUNT * sizeof(uint64));
+	for (i = 0; i < AGG_KEY_COUNT; i++)
+		pgss->agg_heap[i].size = 0;
+
+	hash_seq_init(&hash_seq, pgss_buckethash);
+    while ((objentry = hash_seq_search(&hash_seq)) != NULL)
+    {
+		hash_search(pgss_buckethash, &dbentry->key, HASH_REMOVE, NULL);
+    }
+
+	hash_seq_init(&hash_seq, pgss_waitprofilehash);
+	while ((wpentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgss_waitprofilehash, &wpentry->key, HASH_REMOVE, NULL);
+	}
+
+	hash_seq_init(&hash_seq, pgss_planhash);
+	while ((planentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgss_planhash, &planentry->key, HASH_REMOVE, NULL);
+	}
+	query_text_release(-1);
+	pgss->current_wbucket = 0;
+    free(pgssBucketEntries);
+	LWLockRelease(pgss->lock);
+}
+
+/*
+ * AppendJumble: Append a value that is substantive in a given query to
+ * the current jumble.
+ */
+static void
+AppendJumble(pgssJumbleState *jstate, const unsigned char *item, Size size)
+{
+	unsigned char *jumble = jstate->jumble;
+	Size		jumble_len = jstate->jumble_len;
+
+	/*
+	 * Whenever the jumble buffer is full, we hash the current contents and
+	 * reset the buffer to contain just that hash value, thus relying on the
+	 * hash to summarize everything so far.
+	 */
+	while (size > 0)
+	{
+		Size		part_size;
+
+		if (jumble_len >= JUMBLE_SIZE)
+		{
+			uint64		start_hash;
+
+			start_hash = DatumGetUInt64(hash_any_extended(jumble,
+														  JUMBLE_SIZE, 0));
+			memcpy(jumble, &start_hash, sizeof(start_hash));
+			jumble_len = sizeof(start_hash);
+		}
+		part_size = Min(size, JUMBLE_SIZE - jumble_len);
+		memcpy(jumble + jumble_len, item, part_size);
+		jumble_len += part_size;
+		item += part_size;
+		size -= part_size;
+	}
+	jstate->jumble_len = jumble_len;
+}
+
+/*
+ * Wrappers around AppendJumble to encapsulate details of serialization
+ * of individual local variable elements.
+ */
+#define APP_JUMB(item) \
+	AppendJumble(jstate, (const unsigned char *) &(item), sizeof(item))
+#define APP_JUMB_STRING(str) \
+	AppendJumble(jstate, (const unsigned char *) (str), strlen(str) + 1)
+
+/*
+ * JumbleQuery: Selectively serialize the query tree, appending significant
+ * data to the "query jumble" while ignoring nonsignificant data.
+ *
+ * Rule of thumb for what to include is that we should ignore anything not
+ * semantically significant (such as alias names) as well as anything that can
+ * be deduced from child nodes (else we'd just be double-hashing that piece
+ * of information).
+ */
+static void
+JumbleQuery(pgssJumbleState *jstate, Query *query)
+{
+	Assert(IsA(query, Query));
+	Assert(query->utilityStmt == NULL);
+
+	APP_JUMB(query->commandType);
+	/* resultRelation is usually predictable from commandType */
+	JumbleExpr(jstate, (Node *) query->cteList);
+	JumbleRangeTable(jstate, query->rtable);
+	JumbleExpr(jstate, (Node *) query->jointree);
+	JumbleExpr(jstate, (Node *) query->targetList);
+	JumbleExpr(jstate, (Node *) query->onConflict);
+	JumbleExpr(jstate, (Node *) query->returningList);
+	JumbleExpr(jstate, (Node *) query->groupClause);
+	JumbleExpr(jstate, (Node *) query->groupingSets);
+	JumbleExpr(jstate, query->havingQual);
+	JumbleExpr(jstate, (Node *) query->windowClause);
+	JumbleExpr(jstate, (Node *) query->distinctClause);
+	JumbleExpr(jstate, (Node *) query->sortClause);
+	JumbleExpr(jstate, query->limitOffset);
+	JumbleExpr(jstate, query->limitCount);
+	/* we ignore rowMarks */
+	JumbleExpr(jstate, query->setOperations);
+}
+
+/*
+ * Jumble a range table
+ */
+static void
+JumbleRangeTable(pgssJumbleState *jstate, List *rtable)
+{
+	ListCell   *lc;
+
+	foreach(lc, rtable)
+	{
+		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+
+		APP_JUMB(rte->rtekind);
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION:
+				APP_JUMB(rte->relid);
+				JumbleExpr(jstate, (Node *) rte->tablesample);
+				break;
+			case RTE_SUBQUERY:
+				JumbleQuery(jstate, rte->subquery);
+				break;
+			case RTE_JOIN:
+				APP_JUMB(rte->jointype);
+				break;
+			case RTE_FUNCTION:
+				JumbleExpr(jstate, (Node *) rte->functions);
+				break;
+			case RTE_TABLEFUNC:
+				JumbleExpr(jstate, (Node *) rte->tablefunc);
+				break;
+			case RTE_VALUES:
+				JumbleExpr(jstate, (Node *) rte->values_lists);
 				break;
 			case RTE_CTE:
 
-				/*
-				 * Depending on the CTE name here isn't ideal, but it's the
-				 * only info we have to identify the referenced WITH item.
-				 */
-				APP_JUMB_STRING(rte->ctename);
-				APP_JUMB(rte->ctelevelsup);
-				break;
-			case RTE_NAMEDTUPLESTORE:
-				APP_JUMB_STRING(rte->enrname);
-				break;
-			default:
-				elog(ERROR, "unrecognized RTE kind: %d", (int) rte->rtekind);
-				break;
-		}
+				/*
+				 * Depending on the CTE name here isn't ideal, but it's the
+				 * only info we have to identify the referenced WITH item.
+				 */
+				APP_JUMB_STRING(rte->ctename);
+				APP_JUMB(rte->ctelevelsup);
+				break;
+			case RTE_NAMEDTUPLESTORE:
+				APP_JUMB_STRING(rte->enrname);
+				break;
+			default:
+				elog(ERROR, "unrecognized RTE kind: %d", (int) rte->rtekind);
+				break;
+		}
+	}
+}
+
+/*
+ * Jumble the shape of a plan tree: the node types, the relations and
+ * indexes scanned, and the join and aggregation strategies.  Costs,
+ * expressions and constants are ignored, so that the same plan of a
+ * statement gets the same fingerprint whatever its parameters.
+ */
+static void
+JumblePlan(pgssJumbleState *jstate, Plan *plan, List *rtable)
+{
+	ListCell   *lc;
+	List	   *children = NIL;
+
+	if (plan == NULL)
+		return;
+
+	/* Guard against stack overflow due to overly complex plans */
+	check_stack_depth();
+
+	APP_JUMB(plan->type);
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_ForeignScan:
+			{
+				Scan	   *scan = (Scan *) plan;
+
+				if (scan->scanrelid > 0)
+				{
+					RangeTblEntry *rte = rt_fetch(scan->scanrelid, rtable);
+
+					APP_JUMB(rte->relid);
+				}
+			}
+			break;
+		case T_IndexScan:
+			{
+				IndexScan  *scan = (IndexScan *) plan;
+
+				APP_JUMB(rt_fetch(scan->scan.scanrelid, rtable)->relid);
+				APP_JUMB(scan->indexid);
+			}
+			break;
+		case T_IndexOnlyScan:
+			{
+				IndexOnlyScan *scan = (IndexOnlyScan *) plan;
+
+				APP_JUMB(rt_fetch(scan->scan.scanrelid, rtable)->relid);
+				APP_JUMB(scan->indexid);
+			}
+			break;
+		case T_BitmapIndexScan:
+			APP_JUMB(((BitmapIndexScan *) plan)->indexid);
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			APP_JUMB(((Join *) plan)->jointype);
+			break;
+		case T_Agg:
+			APP_JUMB(((Agg *) plan)->aggstrategy);
+			break;
+		case T_ModifyTable:
+			APP_JUMB(((ModifyTable *) plan)->operation);
+			children = ((ModifyTable *) plan)->plans;
+			break;
+		case T_Append:
+			children = ((Append *) plan)->appendplans;
+			break;
+		case T_MergeAppend:
+			children = ((MergeAppend *) plan)->mergeplans;
+			break;
+		case T_BitmapAnd:
+			children = ((BitmapAnd *) plan)->bitmapplans;
+			break;
+		case T_BitmapOr:
+			children = ((BitmapOr *) plan)->bitmapplans;
+			break;
+		case T_SubqueryScan:
+			JumblePlan(jstate, ((SubqueryScan *) plan)->subplan, rtable);
+			break;
+		case T_CustomScan:
+			children = ((CustomScan *) plan)->custom_plans;
+			break;
+		default:
+			break;
+	}
+
+	foreach(lc, children)
+		JumblePlan(jstate, (Plan *) lfirst(lc), rtable);
+	JumblePlan(jstate, plan->lefttree, rtable);
+	JumblePlan(jstate, plan->righttree, rtable);
+}
+
+/*
+ * Jumble an expression tree
+ *
+ * In general this function should handle all the same node types that
+ * expression_tree_walker() does, and therefore it's coded to be as parallel
+ * to that function as possible.  However, since we are only invoked on
+ * queries immediately post-parse-analysis, we need not handle node types
+ * that only appear in planning.
+ *
+ * Note: the reason we don't simply use expression_tree_walker() is that the
+ * point of that function is to support tree walkers that don't care about
+ * most tree node types, but here we care about all types.  We should complain
+ * about any unrecognized node type.
+ */
+static void
+JumbleExpr(pgssJumbleState *jstate, Node *node)
+{
+	ListCell   *temp;
+
+	if (node == NULL)
+		return;
+
+	/* Guard against stack overflow due to overly complex expressions */
+	check_stack_depth();
+
+	/*
+	 * We always emit the node's NodeTag, then any additional fields that are
+	 * considered significant, and then we recurse to any child nodes.
+	 */
+	APP_JUMB(node->type);
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+			{
+				Var		   *var = (Var *) node;
+
+				APP_JUMB(var->varno);
+				APP_JUMB(var->varattno);
+				APP_JUMB(var->varlevelsup);
+			}
+			break;
+		case T_Const:
+			{
+				Const	   *c = (Const *) node;
+
+				/* We jumble only the constant's type, not its value */
+				APP_JUMB(c->consttype);
+				/* Also, record its parse location for query normalization */
+				RecordConstLocation(jstate, c->location);
+			}
+			break;
+		case T_Param:
+			{
+				Param	   *p = (Param *) node;
+
+				APP_JUMB(p->paramkind);
+				APP_JUMB(p->paramid);
+				APP_JUMB(p->paramtype);
+				/* Also, track the highest external Param id */
+				if (p->paramkind == PARAM_EXTERN &&
+					p->paramid > jstate->highest_extern_param_id)
+					jstate->highest_extern_param_id = p->paramid;
+			}
+			break;
+		case T_Aggref:
+			{
+				Aggref	   *expr = (Aggref *) node;
+
+				APP_JUMB(expr->aggfnoid);
+				JumbleExpr(jstate, (Node *) expr->aggdirectargs);
+				JumbleExpr(jstate, (Node *) expr->args);
+				JumbleExpr(jstate, (Node *) expr->aggorder);
+				JumbleExpr(jstate, (Node *) expr->aggdistinct);
+				JumbleExpr(jstate, (Node *) expr->aggfilter);
+			}
+			break;
+		case T_GroupingFunc:
+			{
+				GroupingFunc *grpnode = (GroupingFunc *) node;
+
+				JumbleExpr(jstate, (Node *) grpnode->refs);
+			}
+			break;
+		case T_WindowFunc:
+			{
+				WindowFunc *expr = (WindowFunc *) node;
+
+				APP_JUMB(expr->winfnoid);
+				APP_JUMB(expr->winref);
+				JumbleExpr(jstate, (Node *) expr->args);
+				JumbleExpr(jstate, (Node *) expr->aggfilter);
+			}
+			break;
+#if PG_VERSION_NUM >= 120000
+		case T_SubscriptingRef:
+			{
+				SubscriptingRef *sbsref = (SubscriptingRef *) node;
+
+				JumbleExpr(jstate, (Node *) sbsref->refupperindexpr);
+				JumbleExpr(jstate, (Node *) sbsref->reflowerindexpr);
+				JumbleExpr(jstate, (Node *) sbsref->refexpr);
+				JumbleExpr(jstate, (Node *) sbsref->refassgnexpr);
+			}
+			break;
+#else
+		case T_ArrayRef:
+			{
+				ArrayRef   *aref = (ArrayRef *) node;
+
+				JumbleExpr(jstate, (Node *) aref->refupperindexpr);
+				JumbleExpr(jstate, (Node *) aref->reflowerindexpr);
+				JumbleExpr(jstate, (Node *) aref->refexpr);
+				JumbleExpr(jstate, (Node *) aref->refassgnexpr);
+			}
+			break;
+#endif
+		case T_FuncExpr:
+			{
+				FuncExpr   *expr = (FuncExpr *) node;
+
+				APP_JUMB(expr->funcid);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_NamedArgExpr:
+			{
+				NamedArgExpr *nae = (NamedArgExpr *) node;
+
+				APP_JUMB(nae->argnumber);
+				JumbleExpr(jstate, (Node *) nae->arg);
+			}
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
+		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
+			{
+				OpExpr	   *expr = (OpExpr *) node;
+
+				APP_JUMB(expr->opno);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *expr = (ScalarArrayOpExpr *) node;
+
+				APP_JUMB(expr->opno);
+				APP_JUMB(expr->useOr);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_BoolExpr:
+			{
+				BoolExpr   *expr = (BoolExpr *) node;
+
+				APP_JUMB(expr->boolop);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_SubLink:
+			{
+				SubLink    *sublink = (SubLink *) node;
+
+				APP_JUMB(sublink->subLinkType);
+				APP_JUMB(sublink->subLinkId);
+				JumbleExpr(jstate, (Node *) sublink->testexpr);
+				JumbleQuery(jstate, castNode(Query, sublink->subselect));
+			}
+			break;
+		case T_FieldSelect:
+			{
+				FieldSelect *fs = (FieldSelect *) node;
+
+				APP_JUMB(fs->fieldnum);
+				JumbleExpr(jstate, (Node *) fs->arg);
+			}
+			break;
+		case T_FieldStore:
+			{
+				FieldStore *fstore = (FieldStore *) node;
+
+				JumbleExpr(jstate, (Node *) fstore->arg);
+				JumbleExpr(jstate, (Node *) fstore->newvals);
+			}
+			break;
+		case T_RelabelType:
+			{
+				RelabelType *rt = (RelabelType *) node;
+
+				APP_JUMB(rt->resulttype);
+				JumbleExpr(jstate, (Node *) rt->arg);
+			}
+			break;
+		case T_CoerceViaIO:
+			{
+				CoerceViaIO *cio = (CoerceViaIO *) node;
+
+				APP_JUMB(cio->resulttype);
+				JumbleExpr(jstate, (Node *) cio->arg);
+			}
+			break;
+		case T_ArrayCoerceExpr:
+			{
+				ArrayCoerceExpr *acexpr = (ArrayCoerceExpr *) node;
+
+				APP_JUMB(acexpr->resulttype);
+				JumbleExpr(jstate, (Node *) acexpr->arg);
+				JumbleExpr(jstate, (Node *) acexpr->elemexpr);
+			}
+			break;
+		case T_ConvertRowtypeExpr:
+			{
+				ConvertRowtypeExpr *crexpr = (ConvertRowtypeExpr *) node;
+
+				APP_JUMB(crexpr->resulttype);
+				JumbleExpr(jstate, (Node *) crexpr->arg);
+			}
+			break;
+		case T_CollateExpr:
+			{
+				CollateExpr *ce = (CollateExpr *) node;
+
+				APP_JUMB(ce->collOid);
+				JumbleExpr(jstate, (Node *) ce->arg);
+			}
+			break;
+		case T_CaseExpr:
+			{
+				CaseExpr   *caseexpr = (CaseExpr *) node;
+
+				JumbleExpr(jstate, (Node *) caseexpr->arg);
+				foreach(temp, caseexpr->args)
+				{
+					CaseWhen   *when = lfirst_node(CaseWhen, temp);
+
+					JumbleExpr(jstate, (Node *) when->expr);
+					JumbleExpr(jstate, (Node *) when->result);
+				}
+				JumbleExpr(jstate, (Node *) caseexpr->defresult);
+			}
+			break;
+		case T_CaseTestExpr:
+			{
+				CaseTestExpr *ct = (CaseTestExpr *) node;
+
+				APP_JUMB(ct->typeId);
+			}
+			break;
+		case T_ArrayExpr:
+			JumbleExpr(jstate, (Node *) ((ArrayExpr *) node)->elements);
+			break;
+		case T_RowExpr:
+			JumbleExpr(jstate, (Node *) ((RowExpr *) node)->args);
+			break;
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+
+				APP_JUMB(rcexpr->rctype);
+				JumbleExpr(jstate, (Node *) rcexpr->largs);
+				JumbleExpr(jstate, (Node *) rcexpr->rargs);
+			}
+			break;
+		case T_CoalesceExpr:
+			JumbleExpr(jstate, (Node *) ((CoalesceExpr *) node)->args);
+			break;
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *mmexpr = (MinMaxExpr *) node;
+
+				APP_JUMB(mmexpr->op);
+				JumbleExpr(jstate, (Node *) mmexpr->args);
+			}
+			break;
+		case T_SQLValueFunction:
+			{
+				SQLValueFunction *svf = (SQLValueFunction *) node;
+
+				APP_JUMB(svf->op);
+				/* type is fully determined by op */
+				APP_JUMB(svf->typmod);
+			}
+			break;
+		case T_XmlExpr:
+			{
+				XmlExpr    *xexpr = (XmlExpr *) node;
+
+				APP_JUMB(xexpr->op);
+				JumbleExpr(jstate, (Node *) xexpr->named_args);
+				JumbleExpr(jstate, (Node *) xexpr->args);
+			}
+			break;
+		case T_NullTest:
+			{
+				NullTest   *nt = (NullTest *) node;
+
+				APP_JUMB(nt->nulltesttype);
+				JumbleExpr(jstate, (Node *) nt->arg);
+			}
+			break;
+		case T_BooleanTest:
+			{
+				BooleanTest *bt = (BooleanTest *) node;
+
+				APP_JUMB(bt->booltesttype);
+				JumbleExpr(jstate, (Node *) bt->arg);
+			}
+			break;
+		case T_CoerceToDomain:
+			{
+				CoerceToDomain *cd = (CoerceToDomain *) node;
+
+				APP_JUMB(cd->resulttype);
+				JumbleExpr(jstate, (Node *) cd->arg);
+			}
+			break;
+		case T_CoerceToDomainValue:
+			{
+				CoerceToDomainValue *cdv = (CoerceToDomainValue *) node;
+
+				APP_JUMB(cdv->typeId);
+			}
+			break;
+		case T_SetToDefault:
+			{
+				SetToDefault *sd = (SetToDefault *) node;
+
+				APP_JUMB(sd->typeId);
+			}
+			break;
+		case T_CurrentOfExpr:
+			{
+				CurrentOfExpr *ce = (CurrentOfExpr *) node;
+
+				APP_JUMB(ce->cvarno);
+				if (ce->cursor_name)
+					APP_JUMB_STRING(ce->cursor_name);
+				APP_JUMB(ce->cursor_param);
+			}
+			break;
+		case T_NextValueExpr:
+			{
+				NextValueExpr *nve = (NextValueExpr *) node;
+
+				APP_JUMB(nve->seqid);
+				APP_JUMB(nve->typeId);
+			}
+			break;
+		case T_InferenceElem:
+			{
+				InferenceElem *ie = (InferenceElem *) node;
+
+				APP_JUMB(ie->infercollid);
+				APP_JUMB(ie->inferopclass);
+				JumbleExpr(jstate, ie->expr);
+			}
+			break;
+		case T_TargetEntry:
+			{
+				TargetEntry *tle = (TargetEntry *) node;
+
+				APP_JUMB(tle->resno);
+				APP_JUMB(tle->ressortgroupref);
+				JumbleExpr(jstate, (Node *) tle->expr);
+			}
+			break;
+		case T_RangeTblRef:
+			{
+				RangeTblRef *rtr = (RangeTblRef *) node;
+
+				APP_JUMB(rtr->rtindex);
+			}
+			break;
+		case T_JoinExpr:
+			{
+				JoinExpr   *join = (JoinExpr *) node;
+
+				APP_JUMB(join->jointype);
+				APP_JUMB(join->isNatural);
+				APP_JUMB(join->rtindex);
+				JumbleExpr(jstate, join->larg);
+				JumbleExpr(jstate, join->rarg);
+				JumbleExpr(jstate, join->quals);
+			}
+			break;
+		case T_FromExpr:
+			{
+				FromExpr   *from = (FromExpr *) node;
+
+				JumbleExpr(jstate, (Node *) from->fromlist);
+				JumbleExpr(jstate, from->quals);
+			}
+			break;
+		case T_OnConflictExpr:
+			{
+				OnConflictExpr *conf = (OnConflictExpr *) node;
+
+				APP_JUMB(conf->action);
+				JumbleExpr(jstate, (Node *) conf->arbiterElems);
+				JumbleExpr(jstate, conf->arbiterWhere);
+				JumbleExpr(jstate, (Node *) conf->onConflictSet);
+				JumbleExpr(jstate, conf->onConflictWhere);
+				APP_JUMB(conf->constraint);
+				APP_JUMB(conf->exclRelIndex);
+				JumbleExpr(jstate, (Node *) conf->exclRelTlist);
+			}
+			break;
+		case T_List:
+			foreach(temp, (List *) node)
+			{
+				JumbleExpr(jstate, (Node *) lfirst(temp));
+			}
+			break;
+		case T_IntList:
+			foreach(temp, (List *) node)
+			{
+				APP_JUMB(lfirst_int(temp));
+			}
+			break;
+		case T_SortGroupClause:
+			{
+				SortGroupClause *sgc = (SortGroupClause *) node;
+
+				APP_JUMB(sgc->tleSortGroupRef);
+				APP_JUMB(sgc->eqop);
+				APP_JUMB(sgc->sortop);
+				APP_JUMB(sgc->nulls_first);
+			}
+			break;
+		case T_GroupingSet:
+			{
+				GroupingSet *gsnode = (GroupingSet *) node;
+
+				JumbleExpr(jstate, (Node *) gsnode->content);
+			}
+			break;
+		case T_WindowClause:
+			{
+				WindowClause *wc = (WindowClause *) node;
+
+				APP_JUMB(wc->winref);
+				APP_JUMB(wc->frameOptions);
+				JumbleExpr(jstate, (Node *) wc->partitionClause);
+				JumbleExpr(jstate, (Node *) wc->orderClause);
+				JumbleExpr(jstate, wc->startOffset);
+				JumbleExpr(jstate, wc->endOffset);
+			}
+			break;
+		case T_CommonTableExpr:
+			{
+				CommonTableExpr *cte = (CommonTableExpr *) node;
+
+				/* we store the string name because RTE_CTE RTEs need it */
+				APP_JUMB_STRING(cte->ctename);
+				JumbleQuery(jstate, castNode(Query, cte->ctequery));
+			}
+			break;
+		case T_SetOperationStmt:
+			{
+				SetOperationStmt *setop = (SetOperationStmt *) node;
+
+				APP_JUMB(setop->op);
+				APP_JUMB(setop->all);
+				JumbleExpr(jstate, setop->larg);
+				JumbleExpr(jstate, setop->rarg);
+			}
+			break;
+		case T_RangeTblFunction:
+			{
+				RangeTblFunction *rtfunc = (RangeTblFunction *) node;
+
+				JumbleExpr(jstate, rtfunc->funcexpr);
+			}
+			break;
+		case T_TableFunc:
+			{
+				TableFunc  *tablefunc = (TableFunc *) node;
+
+				JumbleExpr(jstate, tablefunc->docexpr);
+				JumbleExpr(jstate, tablefunc->rowexpr);
+				JumbleExpr(jstate, (Node *) tablefunc->colexprs);
+			}
+			break;
+		case T_TableSampleClause:
+			{
+				TableSampleClause *tsc = (TableSampleClause *) node;
+
+				APP_JUMB(tsc->tsmhandler);
+				JumbleExpr(jstate, (Node *) tsc->args);
+				JumbleExpr(jstate, (Node *) tsc->repeatable);
+			}
+			break;
+		default:
+			/* Only a warning, since we can stumble along anyway */
+			elog(INFO, "unrecognized node type: %d",
+				 (int) nodeTag(node));
+			break;
+	}
+}
+
+/*
+ * Record location of constant within query string of query tree
+ * that is currently being walked.
+ */
+static void
+RecordConstLocation(pgssJumbleState *jstate, int location)
+{
+	/* -1 indicates unknown or undefined location */
+	if (location >= 0)
+	{
+		/* enlarge array if needed */
+		if (jstate->clocations_count >= jstate->clocations_buf_size)
+		{
+			jstate->clocations_buf_size *= 2;
+			jstate->clocations = (pgssLocationLen *)
+				repalloc(jstate->clocations,
+						 jstate->clocations_buf_size *
+						 sizeof(pgssLocationLen));
+		}
+		jstate->clocations[jstate->clocations_count].location = location;
+		/* initialize lengths to -1 to simplify fill_in_constant_lengths */
+		jstate->clocations[jstate->clocations_count].length = -1;
+		jstate->clocations_count++;
+	}
+}
+
+/*
+ * Generate a normalized version of the query string that will be used to
+ * represent all similar queries.
+ *
+ * Note that the normalized representation may well vary depending on
+ * just which "equivalent" query is used to create the hashtable entry.
+ * We assume this is OK.
+ *
+ * If query_loc > 0, then "query" has been advanced by that much compared to
+ * the original string start, so we need to translate the provided locations
+ * to compensate.  (This lets us avoid re-scanning statements before the one
+ * of interest, so it's worth doing.)
+ *
+ * *query_len_p contains the input string length, and is updated with
+ * the result string length on exit.  The resulting string might be longer
+ * or shorter depending on what happens with replacement of constants.
+ *
+ * Returns a palloc'd string.
+ */
+static char *
+generate_normalized_query(pgssJumbleState *jstate, const char *query,
+						  int query_loc, int *query_len_p, int encoding)
+{
+	char	   *norm_query;
+	int			query_len = *query_len_p;
+	int			i,
+				norm_query_buflen,	/* Space allowed for norm_query */
+				len_to_wrt,		/* Length (in bytes) to write */
+				quer_loc = 0,	/* Source query byte location */
+				n_quer_loc = 0, /* Normalized query byte location */
+				last_off = 0,	/* Offset from start for previous tok */
+				last_tok_len = 0;	/* Length (in bytes) of that tok */
+
+	/*
+	 * Get constants' lengths (core system only gives us locations).  Note
+	 * this also ensures the items are sorted by location.
+	 */
+	fill_in_constant_lengths(jstate, query, query_loc);
+
+	/*
+	 * Allow for $n symbols to be longer than the constants they replace.
+	 * Constants must take at least one byte in text form, while a $n symbol
+	 * certainly isn't more than 11 bytes, even if n reaches INT_MAX.  We
+	 * could refine that limit based on the max value of n for the current
+	 * query, but it hardly seems worth any extra effort to do so.
+	 */
+	norm_query_buflen = query_len + jstate->clocations_count * 10;
+
+	/* Allocate result buffer */
+	norm_query = palloc(norm_query_buflen + 1);
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			off,		/* Offset from start for cur tok */
+					tok_len;	/* Length (in bytes) of that tok */
+
+		off = jstate->clocations[i].location;
+		/* Adjust recorded location if we're dealing with partial string */
+		off -= query_loc;
+
+		tok_len = jstate->clocations[i].length;
+
+		if (tok_len < 0)
+			continue;			/* ignore any duplicates */
+
+		/* Copy next chunk (what precedes the next constant) */
+		len_to_wrt = off - last_off;
+		len_to_wrt -= last_tok_len;
+
+		Assert(len_to_wrt >= 0);
+		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+		n_quer_loc += len_to_wrt;
+
+		/* And insert a param symbol in place of the constant token */
+		n_quer_loc += sprintf(norm_query + n_quer_loc, "$%d",
+							  i + 1 + jstate->highest_extern_param_id);
+
+		quer_loc = off + tok_len;
+		last_off = off;
+		last_tok_len = tok_len;
 	}
+
+	/*
+	 * We've copied up until the last ignorable constant.  Copy over the
+	 * remaining bytes of the original query string.
+	 */
+	len_to_wrt = query_len - quer_loc;
+
+	Assert(len_to_wrt >= 0);
+	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+	n_quer_loc += len_to_wrt;
+
+	Assert(n_quer_loc <= norm_query_buflen);
+	norm_query[n_quer_loc] = '\0';
+
+	*query_len_p = n_quer_loc;
+	return norm_query;
 }
 
 /*
- * Jumble an expression tree
+ * Given a valid SQL string and an array of constant-location records,
+ * fill in the textual lengths of those constants.
  *
- * In general this function should handle all the same node types that
- * expression_tree_walker() does, and therefore it's coded to be as parallel
- * to that function as possible.  However, since we are only invoked on
- * queries immediately post-parse-analysis, we need not handle node types
- * that only appear in planning.
+ * The constants may use any allowed constant syntax, such as float literals,
+ * bit-strings, single-quoted strings and dollar-quoted strings.  This is
+ * accomplished by using the public API for the core scanner.
  *
- * Note: the reason we don't simply use expression_tree_walker() is that the
- * point of that function is to support tree walkers that don't care about
- * most tree node types, but here we care about all types.  We should complain
- * about any unrecognized node type.
+ * It is the caller's job to ensure that the string is a valid SQL statement
+ * with constants at the indicated locations.  Since in practice the string
+ * has already been parsed, and the locations that the caller provides will
+ * have originated from within the authoritative parser, this should not be
+ * a problem.
+ *
+ * Duplicate constant pointers are possible, and will have their lengths
+ * marked as '-1', so that they are later ignored.  (Actually, we assume the
+ * lengths were initialized as -1 to start with, and don't change them here.)
+ *
+ * If query_loc > 0, then "query" has been advanced by that much compared to
+ * the original string start, so we need to translate the provided locations
+ * to compensate.  (This lets us avoid re-scanning statements before the one
+ * of interest, so it's worth doing.)
+ *
+ * N.B. There is an assumption that a '-' character at a Const location begins
+ * a negative numeric constant.  This precludes there ever being another
+ * reason for a constant to start with a '-'.
  */
 static void
-JumbleExpr(pgssJumbleState *jstate, Node *node)
+fill_in_constant_lengths(pgssJumbleState *jstate, const char *query,
+						 int query_loc)
 {
-	ListCell   *temp;
-
-	if (node == NULL)
-		return;
-
-	/* Guard against stack overflow due to overly complex expressions */
-	check_stack_depth();
+	pgssLocationLen		*locs;
+	core_yyscan_t		yyscanner;
+	core_yy_extra_type	yyextra;
+	core_YYSTYPE		yylval;
+	YYLTYPE				yylloc;
+	int					last_loc = -1;
+	int					i;
 
 	/*
-	 * We always emit the node's NodeTag, then any additional fields that are
-	 * considered significant, and then we recurse to any child nodes.
+	 * Sort the records by location so that we can process them in order while
+	 * scanning the query text.
 	 */
-	APP_JUMB(node->type);
+	if (jstate->clocations_count > 1)
+		qsort(jstate->clocations, jstate->clocations_count,
+			  sizeof(pgssLocationLen), comp_location);
+	locs = jstate->clocations;
 
-	switch (nodeTag(node))
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(query,
+							 &yyextra,
+#if PG_VERSION_NUM >= 120000
+							&ScanKeywords,
+							ScanKeywordTokens);
+#else
+							ScanKeywords,
+							NumScanKeywords);
+#endif
+	/* we don't want to re-emit any escape string warnings */
+	yyextra.escape_string_warning = false;
+
+	/* Search for each constant, in sequence */
+	for (i = 0; i < jstate->clocations_count; i++)
 	{
-		case T_Var:
-			{
-				Var		   *var = (Var *) node;
+		int			loc = locs[i].location;
+		int			tok;
 
-				APP_JUMB(var->varno);
-				APP_JUMB(var->varattno);
-				APP_JUMB(var->varlevelsup);
-			}
-			break;
-		case T_Const:
-			{
-				Const	   *c = (Const *) node;
+		/* Adjust recorded location if we're dealing with partial string */
+		loc -= query_loc;
 
-				/* We jumble only the constant's type, not its value */
-				APP_JUMB(c->consttype);
-				/* Also, record its parse location for query normalization */
-				RecordConstLocation(jstate, c->location);
-			}
-			break;
-		case T_Param:
+		Assert(loc >= 0);
+
+		if (loc <= last_loc)
+			continue;			/* Duplicate constant, ignore */
+
+		/* Lex tokens until we find the desired constant */
+		for (;;)
+		{
+			tok = core_yylex(&yylval, &yylloc, yyscanner);
+
+			/* We should not hit end-of-string, but if we do, behave sanely */
+			if (tok == 0)
+				break;			/* out of inner for-loop */
+
+			/*
+			 * We should find the token position exactly, but if we somehow
+			 * run past it, work with that.
+			 */
+			if (yylloc >= loc)
 			{
-				Param	   *p = (Param *) node;
+				if (query[loc] == '-')
+				{
+					/*
+					 * It's a negative value - this is the one and only case
+					 * where we replace more than a single token.
+					 *
+					 * Do not compensate for the core system's special-case
+					 * adjustment of location to that of the leading '-'
+					 * operator in the event of a negative constant.  It is
+					 * also useful for our purposes to start from the minus
+					 * symbol.  In this way, queries like "select * from foo
+					 * where bar = 1" and "select * from foo where bar = -2"
+					 * will have identical normalized query strings.
+					 */
+					tok = core_yylex(&yylval, &yylloc, yyscanner);
+					if (tok == 0)
+						break;	/* out of inner for-loop */
+				}
 
-				APP_JUMB(p->paramkind);
-				APP_JUMB(p->paramid);
-				APP_JUMB(p->paramtype);
-				/* Also, track the highest external Param id */
-				if (p->paramkind == PARAM_EXTERN &&
-					p->paramid > jstate->highest_extern_param_id)
-					jstate->highest_extern_param_id = p->paramid;
+				/*
+				 * We now rely on the assumption that flex has placed a zero
+				 * byte after the text of the current token in scanbuf.
+				 */
+				locs[i].length = strlen(yyextra.scanbuf + loc);
+				break;			/* out of inner for-loop */
 			}
+		}
+
+		/* If we hit end-of-string, give up, leaving remaining lengths -1 */
+		if (tok == 0)
 			break;
-		case T_Aggref:
-			{
-				Aggref	   *expr = (Aggref *) node;
 
-				APP_JUMB(expr->aggfnoid);
-				JumbleExpr(jstate, (Node *) expr->aggdirectargs);
-				JumbleExpr(jstate, (Node *) expr->args);
-				JumbleExpr(jstate, (Node *) expr->aggorder);
-				JumbleExpr(jstate, (Node *) expr->aggdistinct);
-				JumbleExpr(jstate, (Node *) expr->aggfilter);
-			}
-			break;
-		case T_GroupingFunc:
-			{
-				GroupingFunc *grpnode = (GroupingFunc *) node;
+		last_loc = loc;
+	}
+
+	scanner_finish(yyscanner);
+}
+
+/*
+ * comp_location: comparator for qsorting pgssLocationLen structs by location
+ */
+static int
+comp_location(const void *a, const void *b)
+{
+	int	l = ((const pgssLocationLen *) a)->location;
+	int	r = ((const pgssLocationLen *) b)->location;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
+/* Convert array into Text dataum */
+static Datum
+array_get_datum(int arr[])
+{
+	Datum	elems[MAX_RESPONSE_BUCKET];
+	int		j;
+
+	for (j = 0; j < MAX_RESPONSE_BUCKET; j++)
+		elems[j] = Int64GetDatum((int64) arr[j]);
+
+	return PointerGetDatum(construct_array(elems, MAX_RESPONSE_BUCKET,
+										   INT8OID, sizeof(int64),
+										   FLOAT8PASSBYVAL, 'd'));
+}
+
+/* Alocate memory for a new entry */
+void add_object_entry(uint64 queryid, char *objects)
+{
+	pgssObjectEntry	*entry = NULL;
+	bool			found;
+	pgssObjectHashKey key;
+
+	key.queryid = queryid;
+	entry = (pgssObjectEntry *) hash_search(pgss_object_hash, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		SpinLockAcquire(&entry->mutex);
+		snprintf(entry->tables_name, MAX_REL_LEN, "%s", objects);
+		SpinLockRelease(&entry->mutex);
+	}
+}
+
+/*
+ * Total number of aggregate entries, over all the dimensions.
+ */
+static Size
+agg_capacity(void)
+{
+	Size	capacity = 0;
+	int		i;
+
+	for (i = 0; i < AGG_KEY_COUNT; i++)
+		capacity = add_size(capacity, PGSM_AGG_MAX(i));
+	return capacity;
+}
 
-				JumbleExpr(jstate, (Node *) grpnode->refs);
-			}
-			break;
-		case T_WindowFunc:
-			{
-				WindowFunc *expr = (WindowFunc *) node;
+/* Weight of an aggregate in its dimension's heap: its calls */
+static double
+agg_entry_weight(void *entry)
+{
+	return (double) pg_atomic_read_u64(&((pgssAggEntry *) entry)->counters.calls);
+}
 
-				APP_JUMB(expr->winfnoid);
-				APP_JUMB(expr->winref);
-				JumbleExpr(jstate, (Node *) expr->args);
-				JumbleExpr(jstate, (Node *) expr->aggfilter);
-			}
-			break;
-#if PG_VERSION_NUM >= 120000
-		case T_SubscriptingRef:
-			{
-				SubscriptingRef *sbsref = (SubscriptingRef *) node;
+/*
+ * Remove the least called aggregate of a dimension, to make room for a new
+ * one.  Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+agg_entry_evict(uint64 type)
+{
+	pgssAggEntry	*victim;
 
-				JumbleExpr(jstate, (Node *) sbsref->refupperindexpr);
-				JumbleExpr(jstate, (Node *) sbsref->reflowerindexpr);
-				JumbleExpr(jstate, (Node *) sbsref->refexpr);
-				JumbleExpr(jstate, (Node *) sbsref->refassgnexpr);
-			}
-			break;
-#else
-		case T_ArrayRef:
-			{
-				ArrayRef   *aref = (ArrayRef *) node;
+	victim = (pgssAggEntry *) heap_min(&pgss->agg_heap[type], agg_entry_weight, 0);
+	if (victim == NULL)
+		return;
 
-				JumbleExpr(jstate, (Node *) aref->refupperindexpr);
-				JumbleExpr(jstate, (Node *) aref->reflowerindexpr);
-				JumbleExpr(jstate, (Node *) aref->refexpr);
-				JumbleExpr(jstate, (Node *) aref->refassgnexpr);
-			}
-			break;
-#endif
-		case T_FuncExpr:
-			{
-				FuncExpr   *expr = (FuncExpr *) node;
+	heap_remove(&pgss->agg_heap[type], victim);
+	hash_search(pgss_agghash, &victim->key, HASH_REMOVE, NULL);
+	pgss->agg_entries[type]--;
+	pgss->agg_evicted[type]++;
+}
 
-				APP_JUMB(expr->funcid);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_NamedArgExpr:
-			{
-				NamedArgExpr *nae = (NamedArgExpr *) node;
+/*
+ * Find the aggregate entry of key, allocating it if create is true.  Each
+ * dimension has its own capacity; when it is reached the least called
+ * aggregate of the dimension makes room for the new one.
+ * Allocation requires an exclusive lock on pgss->lock.
+ */
+static pgssAggEntry *
+agg_entry_alloc(pgssAggHashKey *key, bool create)
+{
+	pgssAggEntry	*entry = NULL;
+	pgssAggCounters	*c;
+	bool			found;
+	int				i;
 
-				APP_JUMB(nae->argnumber);
-				JumbleExpr(jstate, (Node *) nae->arg);
-			}
-			break;
-		case T_OpExpr:
-		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
-		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
-			{
-				OpExpr	   *expr = (OpExpr *) node;
+	entry = (pgssAggEntry *) hash_search(pgss_agghash, key, HASH_FIND, NULL);
+	if (entry || !create)
+		return entry;
 
-				APP_JUMB(expr->opno);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_ScalarArrayOpExpr:
-			{
-				ScalarArrayOpExpr *expr = (ScalarArrayOpExpr *) node;
+	if (pgss->agg_entries[key->type] >= PGSM_AGG_MAX(key->type))
+	{
+		pgss->agg_overflow[key->type]++;
+		agg_entry_evict(key->type);
+	}
 
-				APP_JUMB(expr->opno);
-				APP_JUMB(expr->useOr);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_BoolExpr:
-			{
-				BoolExpr   *expr = (BoolExpr *) node;
+	entry = (pgssAggEntry *) hash_search(pgss_agghash, key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		/* Out of shared memory */
+		pgss->agg_overflow[key->type]++;
+		return NULL;
+	}
+	if (!found)
+	{
+		pgss->agg_entries[key->type]++;
+		c = &entry->counters;
+		pg_atomic_init_u64(&c->calls, 0);
+		pg_atomic_init_u64(&c->rows, 0);
+		pg_atomic_init_u64(&c->total_time, 0);
+		pg_atomic_init_u64(&c->min_time, PG_UINT64_MAX);
+		pg_atomic_init_u64(&c->max_time, 0);
+		pg_atomic_init_u64(&c->shared_blks_hit, 0);
+		pg_atomic_init_u64(&c->shared_blks_read, 0);
+		pg_atomic_init_u64(&c->utime, 0);
+		pg_atomic_init_u64(&c->stime, 0);
+		for (i = 0; i < MAX_RESPONSE_BUCKET; i++)
+			pg_atomic_init_u64(&c->resp_calls[i], 0);
+		pg_atomic_init_u64(&c->userdb, 0);
+		pg_atomic_init_u32(&c->host, 0);
+		entry->label[0] = '\0';
+		heap_push(&pgss->agg_heap[key->type], entry, 0);
+	}
+	return entry;
+}
 
-				APP_JUMB(expr->boolop);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_SubLink:
-			{
-				SubLink    *sublink = (SubLink *) node;
+/*
+ * Lower *ptr to val, if that is smaller.  Once the minimum has settled most
+ * executions only read it.
+ */
+static inline void
+agg_atomic_min(pg_atomic_uint64 *ptr, uint64 val)
+{
+	uint64	cur = pg_atomic_read_u64(ptr);
 
-				APP_JUMB(sublink->subLinkType);
-				APP_JUMB(sublink->subLinkId);
-				JumbleExpr(jstate, (Node *) sublink->testexpr);
-				JumbleQuery(jstate, castNode(Query, sublink->subselect));
-			}
-			break;
-		case T_FieldSelect:
-			{
-				FieldSelect *fs = (FieldSelect *) node;
+	while (val < cur && !pg_atomic_compare_exchange_u64(ptr, &cur, val))
+		;
+}
 
-				APP_JUMB(fs->fieldnum);
-				JumbleExpr(jstate, (Node *) fs->arg);
-			}
-			break;
-		case T_FieldStore:
-			{
-				FieldStore *fstore = (FieldStore *) node;
+/* Raise *ptr to val, if that is larger */
+static inline void
+agg_atomic_max(pg_atomic_uint64 *ptr, uint64 val)
+{
+	uint64	cur = pg_atomic_read_u64(ptr);
 
-				JumbleExpr(jstate, (Node *) fstore->arg);
-				JumbleExpr(jstate, (Node *) fstore->newvals);
-			}
-			break;
-		case T_RelabelType:
-			{
-				RelabelType *rt = (RelabelType *) node;
+	while (val > cur && !pg_atomic_compare_exchange_u64(ptr, &cur, val))
+		;
+}
 
-				APP_JUMB(rt->resulttype);
-				JumbleExpr(jstate, (Node *) rt->arg);
-			}
-			break;
-		case T_CoerceViaIO:
-			{
-				CoerceViaIO *cio = (CoerceViaIO *) node;
+/*
+ * Add the statistics of a statement to its aggregates, one per enabled
+ * dimension.  Returns false, without updating anything, if an aggregate
+ * entry is missing and create is false.
+ */
+static bool
+update_agg_counters(uint64 bucket, uint64 queryid, Oid userid, Oid dbid, uint host,
+					double total_time, uint64 rows, double weight,
+					const BufferUsage *bufusage, float utime, float stime,
+					bool create)
+{
+	pgssAggEntry	*entries[AGG_KEY_COUNT];
+	uint64			usec = AGG_USEC(total_time);
+	int				resp = get_resp_bucket(total_time);
+	int				port_first = -1;
+	char			port_label[NAMEDATALEN];
+	int				i;
 
-				APP_JUMB(cio->resulttype);
-				JumbleExpr(jstate, (Node *) cio->arg);
-			}
-			break;
-		case T_ArrayCoerceExpr:
-			{
-				ArrayCoerceExpr *acexpr = (ArrayCoerceExpr *) node;
+	if (AGG_KEY_ENABLED(AGG_KEY_CLIENT_PORT) &&
+		(port_first = pg_get_client_port_range()) >= 0)
+		snprintf(port_label, sizeof(port_label), "%d-%d", port_first,
+				 Min(port_first + PGSM_AGG_PORT_RANGE - 1, 65535));
 
-				APP_JUMB(acexpr->resulttype);
-				JumbleExpr(jstate, (Node *) acexpr->arg);
-				JumbleExpr(jstate, (Node *) acexpr->elemexpr);
-			}
-			break;
-		case T_ConvertRowtypeExpr:
-			{
-				ConvertRowtypeExpr *crexpr = (ConvertRowtypeExpr *) node;
+	for (i = 0; i < AGG_KEY_COUNT; i++)
+	{
+		pgssAggHashKey	key;
+		const char		*label = NULL;
 
-				APP_JUMB(crexpr->resulttype);
-				JumbleExpr(jstate, (Node *) crexpr->arg);
-			}
-			break;
-		case T_CollateExpr:
-			{
-				CollateExpr *ce = (CollateExpr *) node;
+		entries[i] = NULL;
+		if (!AGG_KEY_ENABLED(i))
+			continue;
 
-				APP_JUMB(ce->collOid);
-				JumbleExpr(jstate, (Node *) ce->arg);
-			}
-			break;
-		case T_CaseExpr:
-			{
-				CaseExpr   *caseexpr = (CaseExpr *) node;
+		key.type = (int64) i;
+		key.queryid = queryid;
+		key.bucket_id = bucket;
+		switch ((AGG_KEY) i)
+		{
+			case AGG_KEY_DATABASE:
+				key.id = dbid;
+				break;
+			case AGG_KEY_USER:
+				key.id = userid;
+				break;
+			case AGG_KEY_HOST:
+				key.id = host;
+				break;
+			case AGG_KEY_APPNAME:
+				label = application_name;
+				break;
+			case AGG_KEY_TAG:
+				label = pgsm_tag;
+				break;
+			case AGG_KEY_CLIENT_PORT:
+				/* Unix-domain socket and background sessions have no port */
+				if (port_first < 0)
+					continue;
+				key.id = port_first;
+				break;
+			default:
+				break;
+		}
 
-				JumbleExpr(jstate, (Node *) caseexpr->arg);
-				foreach(temp, caseexpr->args)
-				{
-					CaseWhen   *when = lfirst_node(CaseWhen, temp);
+		/* Sessions without one are not aggregated by it */
+		if (label != NULL)
+		{
+			if (label[0] == '\0')
+				continue;
+			key.id = pgss_hash_string(label, strlen(label));
+		}
+		else if (i == AGG_KEY_CLIENT_PORT)
+			label = port_label;
+
+		entries[i] = agg_entry_alloc(&key, create);
+		if (entries[i] == NULL && !create)
+			return false;
+		if (entries[i] != NULL && label != NULL && entries[i]->label[0] == '\0')
+			strlcpy(entries[i]->label, label, NAMEDATALEN);
+	}
 
-					JumbleExpr(jstate, (Node *) when->expr);
-					JumbleExpr(jstate, (Node *) when->result);
-				}
-				JumbleExpr(jstate, (Node *) caseexpr->defresult);
-			}
-			break;
-		case T_CaseTestExpr:
-			{
-				CaseTestExpr *ct = (CaseTestExpr *) node;
+	for (i = 0; i < AGG_KEY_COUNT; i++)
+	{
+		pgssAggCounters	*c;
 
-				APP_JUMB(ct->typeId);
-			}
-			break;
-		case T_ArrayExpr:
-			JumbleExpr(jstate, (Node *) ((ArrayExpr *) node)->elements);
-			break;
-		case T_RowExpr:
-			JumbleExpr(jstate, (Node *) ((RowExpr *) node)->args);
-			break;
-		case T_RowCompareExpr:
-			{
-				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+		/* Out of shared memory */
+		if (entries[i] == NULL)
+			continue;
+		c = &entries[i]->counters;
+
+		pg_atomic_fetch_add_u64(&c->calls, (uint64) rint(weight * AGG_CALLS_SCALE));
+		pg_atomic_fetch_add_u64(&c->rows, SAMPLE_SCALE(rows, weight));
+		pg_atomic_fetch_add_u64(&c->total_time, AGG_USEC(total_time * weight));
+		agg_atomic_min(&c->min_time, usec);
+		agg_atomic_max(&c->max_time, usec);
+		pg_atomic_fetch_add_u64(&c->shared_blks_hit, SAMPLE_SCALE(bufusage->shared_blks_hit, weight));
+		pg_atomic_fetch_add_u64(&c->shared_blks_read, SAMPLE_SCALE(bufusage->shared_blks_read, weight));
+		pg_atomic_fetch_add_u64(&c->utime, AGG_USEC(utime * weight));
+		pg_atomic_fetch_add_u64(&c->stime, AGG_USEC(stime * weight));
+		if (resp >= 0)
+			pg_atomic_fetch_add_u64(&c->resp_calls[resp], (uint64) rint(weight));
+		pg_atomic_write_u64(&c->userdb, ((uint64) userid << 32) | dbid);
+		pg_atomic_write_u32(&c->host, host);
+	}
+	return true;
+}
 
-				APP_JUMB(rcexpr->rctype);
-				JumbleExpr(jstate, (Node *) rcexpr->largs);
-				JumbleExpr(jstate, (Node *) rcexpr->rargs);
-			}
-			break;
-		case T_CoalesceExpr:
-			JumbleExpr(jstate, (Node *) ((CoalesceExpr *) node)->args);
-			break;
-		case T_MinMaxExpr:
-			{
-				MinMaxExpr *mmexpr = (MinMaxExpr *) node;
+/*
+ * Response time histogram slot of an execution time, or -1 if it falls in
+ * none of them.
+ */
+static int
+get_resp_bucket(double total_time)
+{
+	int		i;
+
+	for (i = 0; i < MAX_RESPONSE_BUCKET - 1; i++)
+	{
+		if (total_time < PGSM_RESPOSE_TIME_LOWER_BOUND + (PGSM_RESPOSE_TIME_STEP * i))
+			return i;
+	}
+	if (total_time > PGSM_RESPOSE_TIME_LOWER_BOUND + (PGSM_RESPOSE_TIME_STEP * MAX_RESPONSE_BUCKET))
+		return MAX_RESPONSE_BUCKET - 1;
+	return -1;
+}
+
+#define PG_STAT_AGG_USAGE_COLS	6
+
+/*
+ * Usage of the aggregate hash table, per dimension.
+ */
+Datum
+pg_stat_agg_usage(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	int					type;
 
-				APP_JUMB(mmexpr->op);
-				JumbleExpr(jstate, (Node *) mmexpr->args);
-			}
-			break;
-		case T_SQLValueFunction:
-			{
-				SQLValueFunction *svf = (SQLValueFunction *) node;
+	/* hash table must exist already */
+	if (!pgss || !pgss_agghash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
 
-				APP_JUMB(svf->op);
-				/* type is fully determined by op */
-				APP_JUMB(svf->typmod);
-			}
-			break;
-		case T_XmlExpr:
-			{
-				XmlExpr    *xexpr = (XmlExpr *) node;
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: set-valued function called in context that cannot accept a set")));
 
-				APP_JUMB(xexpr->op);
-				JumbleExpr(jstate, (Node *) xexpr->named_args);
-				JumbleExpr(jstate, (Node *) xexpr->args);
-			}
-			break;
-		case T_NullTest:
-			{
-				NullTest   *nt = (NullTest *) node;
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-				APP_JUMB(nt->nulltesttype);
-				JumbleExpr(jstate, (Node *) nt->arg);
-			}
-			break;
-		case T_BooleanTest:
-			{
-				BooleanTest *bt = (BooleanTest *) node;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "pg_stat_monitor: return type must be a row type");
 
-				APP_JUMB(bt->booltesttype);
-				JumbleExpr(jstate, (Node *) bt->arg);
-			}
-			break;
-		case T_CoerceToDomain:
-			{
-				CoerceToDomain *cd = (CoerceToDomain *) node;
+	if (tupdesc->natts != PG_STAT_AGG_USAGE_COLS)
+		elog(ERROR, "pg_stat_monitor: incorrect number of output arguments, required %d", tupdesc->natts);
 
-				APP_JUMB(cd->resulttype);
-				JumbleExpr(jstate, (Node *) cd->arg);
-			}
-			break;
-		case T_CoerceToDomainValue:
-			{
-				CoerceToDomainValue *cdv = (CoerceToDomainValue *) node;
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-				APP_JUMB(cdv->typeId);
-			}
-			break;
-		case T_SetToDefault:
-			{
-				SetToDefault *sd = (SetToDefault *) node;
+	MemoryContextSwitchTo(oldcontext);
 
-				APP_JUMB(sd->typeId);
-			}
-			break;
-		case T_CurrentOfExpr:
-			{
-				CurrentOfExpr *ce = (CurrentOfExpr *) node;
+	LWLockAcquire(pgss->lock, LW_SHARED);
+	for (type = 0; type < AGG_KEY_COUNT; type++)
+	{
+		Datum		values[PG_STAT_AGG_USAGE_COLS];
+		bool		nulls[PG_STAT_AGG_USAGE_COLS];
+		int			i = 0;
 
-				APP_JUMB(ce->cvarno);
-				if (ce->cursor_name)
-					APP_JUMB_STRING(ce->cursor_name);
-				APP_JUMB(ce->cursor_param);
-			}
-			break;
-		case T_NextValueExpr:
-			{
-				NextValueExpr *nve = (NextValueExpr *) node;
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-				APP_JUMB(nve->seqid);
-				APP_JUMB(nve->typeId);
-			}
-			break;
-		case T_InferenceElem:
-			{
-				InferenceElem *ie = (InferenceElem *) node;
+		values[i++] = CStringGetTextDatum(agg_dimension_names[type]);
+		values[i++] = BoolGetDatum(AGG_KEY_ENABLED(type));
+		values[i++] = Int64GetDatum((int64) pgss->agg_entries[type]);
+		values[i++] = Int64GetDatum((int64) PGSM_AGG_MAX(type));
+		values[i++] = Int64GetDatum((int64) pgss->agg_overflow[type]);
+		values[i++] = Int64GetDatum((int64) pgss->agg_evicted[type]);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(pgss->lock);
 
-				APP_JUMB(ie->infercollid);
-				APP_JUMB(ie->inferopclass);
-				JumbleExpr(jstate, ie->expr);
-			}
-			break;
-		case T_TargetEntry:
-			{
-				TargetEntry *tle = (TargetEntry *) node;
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
 
-				APP_JUMB(tle->resno);
-				APP_JUMB(tle->ressortgroupref);
-				JumbleExpr(jstate, (Node *) tle->expr);
-			}
-			break;
-		case T_RangeTblRef:
-			{
-				RangeTblRef *rtr = (RangeTblRef *) node;
+#define PG_STAT_AGG_COLS	22
 
-				APP_JUMB(rtr->rtindex);
-			}
-			break;
-		case T_JoinExpr:
-			{
-				JoinExpr   *join = (JoinExpr *) node;
+/*
+ * Aggregates per database, user and host, computed in a single pass over
+ * the aggregate hash table.
+ */
+Datum
+pg_stat_agg(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo		*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	HASH_SEQ_STATUS		hash_seq;
+	pgssAggEntry		*entry;
 
-				APP_JUMB(join->jointype);
-				APP_JUMB(join->isNatural);
-				APP_JUMB(join->rtindex);
-				JumbleExpr(jstate, join->larg);
-				JumbleExpr(jstate, join->rarg);
-				JumbleExpr(jstate, join->quals);
-			}
-			break;
-		case T_FromExpr:
-			{
-				FromExpr   *from = (FromExpr *) node;
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash || !pgss_agghash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
 
-				JumbleExpr(jstate, (Node *) from->fromlist);
-				JumbleExpr(jstate, from->quals);
-			}
-			break;
-		case T_OnConflictExpr:
-			{
-				OnConflictExpr *conf = (OnConflictExpr *) node;
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: set-valued function called in context that cannot accept a set")));
 
-				APP_JUMB(conf->action);
-				JumbleExpr(jstate, (Node *) conf->arbiterElems);
-				JumbleExpr(jstate, conf->arbiterWhere);
-				JumbleExpr(jstate, (Node *) conf->onConflictSet);
-				JumbleExpr(jstate, conf->onConflictWhere);
-				APP_JUMB(conf->constraint);
-				APP_JUMB(conf->exclRelIndex);
-				JumbleExpr(jstate, (Node *) conf->exclRelTlist);
-			}
-			break;
-		case T_List:
-			foreach(temp, (List *) node)
-			{
-				JumbleExpr(jstate, (Node *) lfirst(temp));
-			}
-			break;
-		case T_IntList:
-			foreach(temp, (List *) node)
-			{
-				APP_JUMB(lfirst_int(temp));
-			}
-			break;
-		case T_SortGroupClause:
-			{
-				SortGroupClause *sgc = (SortGroupClause *) node;
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_stat_monitor: materialize mode required, but it is not " \
+						"allowed in this context")));
 
-				APP_JUMB(sgc->tleSortGroupRef);
-				APP_JUMB(sgc->eqop);
-				APP_JUMB(sgc->sortop);
-				APP_JUMB(sgc->nulls_first);
-			}
-			break;
-		case T_GroupingSet:
-			{
-				GroupingSet *gsnode = (GroupingSet *) node;
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-				JumbleExpr(jstate, (Node *) gsnode->content);
-			}
-			break;
-		case T_WindowClause:
-			{
-				WindowClause *wc = (WindowClause *) node;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "pg_stat_monitor: return type must be a row type");
 
-				APP_JUMB(wc->winref);
-				APP_JUMB(wc->frameOptions);
-				JumbleExpr(jstate, (Node *) wc->partitionClause);
-				JumbleExpr(jstate, (Node *) wc->orderClause);
-				JumbleExpr(jstate, wc->startOffset);
-				JumbleExpr(jstate, wc->endOffset);
-			}
-			break;
-		case T_CommonTableExpr:
-			{
-				CommonTableExpr *cte = (CommonTableExpr *) node;
+	if (tupdesc->natts != PG_STAT_AGG_COLS)
+		elog(ERROR, "pg_stat_monitor: incorrect number of output arguments, required %d", tupdesc->natts);
 
-				/* we store the string name because RTE_CTE RTEs need it */
-				APP_JUMB_STRING(cte->ctename);
-				JumbleQuery(jstate, castNode(Query, cte->ctequery));
-			}
-			break;
-		case T_SetOperationStmt:
-			{
-				SetOperationStmt *setop = (SetOperationStmt *) node;
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * Get shared lock, load or reload the query text file if we must, and
+	 * iterate over the hashtable entries.
+	 *
+	 * With a large hash table, we might be holding the lock rather longer
+	 * than one could wish.  However, this only blocks creation of new hash
+	 * table entries, and the larger the hash table the less likely that is to
+	 * be needed.  So we can hope this is okay.  Perhaps someday we'll decide
+	 * we need to partition the hash table to limit the time spent holding any
+	 * one lock.
+	 */
+	LWLockAcquire(pgss->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pgss_agghash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum			values[PG_STAT_AGG_COLS];
+		bool			nulls[PG_STAT_AGG_COLS];
+		int				i = 0;
+		pgssAggCounters	*c = &entry->counters;
+		pgssHashKey		key;
+		pgssEntry		*qentry;
+		char			tables_name[MAX_REL_LEN] = {0};
+		uint64			userdb = pg_atomic_read_u64(&c->userdb);
+		uint			host = pg_atomic_read_u32(&c->host);
+		double			calls = (double) pg_atomic_read_u64(&c->calls) / AGG_CALLS_SCALE;
+		double			total_time = pg_atomic_read_u64(&c->total_time) / 1000.0;
+		Datum			resp_calls[MAX_RESPONSE_BUCKET];
+		int				j;
 
-				APP_JUMB(setop->op);
-				APP_JUMB(setop->all);
-				JumbleExpr(jstate, setop->larg);
-				JumbleExpr(jstate, setop->rarg);
-			}
-			break;
-		case T_RangeTblFunction:
-			{
-				RangeTblFunction *rtfunc = (RangeTblFunction *) node;
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-				JumbleExpr(jstate, rtfunc->funcexpr);
-			}
-			break;
-		case T_TableFunc:
-			{
-				TableFunc  *tablefunc = (TableFunc *) node;
+		/* The tables are those of the statement the aggregate was last fed by */
+		key.bucket_id = entry->key.bucket_id;
+		key.queryid = entry->key.queryid;
+		key.userid = (Oid) (userdb >> 32);
+		key.dbid = (Oid) userdb;
+		qentry = (pgssEntry *) hash_search(pgss_hash, &key, HASH_FIND, NULL);
+		if (qentry)
+		{
+			volatile pgssEntry *e = (volatile pgssEntry *) qentry;
+			SpinLockAcquire(&e->mutex);
+			memcpy(tables_name, (char *) e->counters.info.tables_name, MAX_REL_LEN);
+			SpinLockRelease(&e->mutex);
+		}
 
-				JumbleExpr(jstate, tablefunc->docexpr);
-				JumbleExpr(jstate, tablefunc->rowexpr);
-				JumbleExpr(jstate, (Node *) tablefunc->colexprs);
-			}
-			break;
-		case T_TableSampleClause:
-			{
-				TableSampleClause *tsc = (TableSampleClause *) node;
+		for (j = 0; j < MAX_RESPONSE_BUCKET; j++)
+			resp_calls[j] = Int64GetDatum((int64) pg_atomic_read_u64(&c->resp_calls[j]));
 
-				APP_JUMB(tsc->tsmhandler);
-				JumbleExpr(jstate, (Node *) tsc->args);
-				JumbleExpr(jstate, (Node *) tsc->repeatable);
-			}
-			break;
-		default:
-			/* Only a warning, since we can stumble along anyway */
-			elog(INFO, "unrecognized node type: %d",
-				 (int) nodeTag(node));
-			break;
+		values[i++] = Int32GetDatum((int32) entry->key.bucket_id);
+		values[i++] = Int64GetDatum((int64) entry->key.queryid);
+		values[i++] = Int64GetDatum((int64) entry->key.id);
+		values[i++] = Int64GetDatum((int64) entry->key.type);
+		if (entry->label[0] == '\0')
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(entry->label);
+		values[i++] = ObjectIdGetDatum(key.userid);
+		values[i++] = ObjectIdGetDatum(key.dbid);
+		values[i++] = Int64GetDatum((int64) host);
+		values[i++] = client_ip_datum(host);
+		values[i++] = Int64GetDatum((int64) rint(calls));
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->rows));
+		values[i++] = Float8GetDatum(total_time);
+		if (calls > 0)
+		{
+			values[i++] = Float8GetDatum(pg_atomic_read_u64(&c->min_time) / 1000.0);
+			values[i++] = Float8GetDatum(pg_atomic_read_u64(&c->max_time) / 1000.0);
+			values[i++] = Float8GetDatum(total_time / calls);
+		}
+		else
+		{
+			values[i++] = Float8GetDatum(0.0);
+			values[i++] = Float8GetDatum(0.0);
+			values[i++] = Float8GetDatum(0.0);
+		}
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->shared_blks_hit));
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->shared_blks_read));
+		values[i++] = PointerGetDatum(construct_array(resp_calls, MAX_RESPONSE_BUCKET,
+													  INT8OID, sizeof(int64),
+													  FLOAT8PASSBYVAL, 'd'));
+		values[i++] = Float8GetDatum(pg_atomic_read_u64(&c->utime) / 1000.0);
+		values[i++] = Float8GetDatum(pg_atomic_read_u64(&c->stime) / 1000.0);
+		if (strlen(tables_name) == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(tables_name);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
+
+	/* clean up and return the tuplestore */
+	LWLockRelease(pgss->lock);
+	tuplestore_donestoring(tupstore);
+	return 0;
 }
 
+#define QBUF_OFFSET(pos)	((pos) % query_buf_size)
+
 /*
- * Record location of constant within query string of query tree
- * that is currently being walked.
+ * Take a reference from the bucket on the text of queryid, if the text
+ * store already has it.  Only needs a shared lock on pgss->lock.
  */
-static void
-RecordConstLocation(pgssJumbleState *jstate, int location)
+static bool
+query_text_ref(uint64 bucket_id, pgssTextKind kind, uint64 id)
 {
-	/* -1 indicates unknown or undefined location */
-	if (location >= 0)
-	{
-		/* enlarge array if needed */
-		if (jstate->clocations_count >= jstate->clocations_buf_size)
-		{
-			jstate->clocations_buf_size *= 2;
-			jstate->clocations = (pgssLocationLen *)
-				repalloc(jstate->clocations,
-						 jstate->clocations_buf_size *
-						 sizeof(pgssLocationLen));
-		}
-		jstate->clocations[jstate->clocations_count].location = location;
-		/* initialize lengths to -1 to simplify fill_in_constant_lengths */
-		jstate->clocations[jstate->clocations_count].length = -1;
-		jstate->clocations_count++;
-	}
+	pgssTextHashKey	key;
+	pgssTextEntry	*text;
+
+	memset(&key, 0, sizeof(pgssTextHashKey));
+	key.id = id;
+	key.kind = kind;
+	text = (pgssTextEntry *) hash_search(pgss_texthash, &key, HASH_FIND, NULL);
+	if (text == NULL)
+		return false;
+
+	/*
+	 * Most statements find the bit already set; reading first keeps the
+	 * cache line shared instead of dirtying it on every execution.
+	 */
+	if ((pg_atomic_read_u32(&text->refs) & ((uint32) 1 << bucket_id)) == 0)
+		pg_atomic_fetch_or_u32(&text->refs, (uint32) 1 << bucket_id);
+	return true;
 }
 
 /*
- * Generate a normalized version of the query string that will be used to
- * represent all similar queries.
- *
- * Note that the normalized representation may well vary depending on
- * just which "equivalent" query is used to create the hashtable entry.
- * We assume this is OK.
- *
- * If query_loc > 0, then "query" has been advanced by that much compared to
- * the original string start, so we need to translate the provided locations
- * to compensate.  (This lets us avoid re-scanning statements before the one
- * of interest, so it's worth doing.)
- *
- * *query_len_p contains the input string length, and is updated with
- * the result string length on exit.  The resulting string might be longer
- * or shorter depending on what happens with replacement of constants.
- *
- * Returns a palloc'd string.
+ * Return the text of a query as a text datum in the server encoding, or NULL
+ * if it is not available.  The text is copied (or decompressed) straight
+ * from the store into the datum.
  */
-static char *
-generate_normalized_query(pgssJumbleState *jstate, const char *query,
-						  int query_loc, int *query_len_p, int encoding)
+static text *
+locate_query(pgssTextKind kind, uint64 id, int encoding, char *qfile, Size qfile_size)
 {
-	char	   *norm_query;
-	int			query_len = *query_len_p;
-	int			i,
-				norm_query_buflen,	/* Space allowed for norm_query */
-				len_to_wrt,		/* Length (in bytes) to write */
-				quer_loc = 0,	/* Source query byte location */
-				n_quer_loc = 0, /* Normalized query byte location */
-				last_off = 0,	/* Offset from start for previous tok */
-				last_tok_len = 0;	/* Length (in bytes) of that tok */
+	pgssTextHashKey	key;
+	pgssTextEntry	*text;
+	unsigned char	*src;
+	struct varlena	*result;
 
-	/*
-	 * Get constants' lengths (core system only gives us locations).  Note
-	 * this also ensures the items are sorted by location.
-	 */
-	fill_in_constant_lengths(jstate, query, query_loc);
+	memset(&key, 0, sizeof(pgssTextHashKey));
+	key.id = id;
+	key.kind = kind;
+	text = (pgssTextEntry *) hash_search(pgss_texthash, &key, HASH_FIND, NULL);
+	if (text == NULL)
+		return NULL;
 
-	/*
-	 * Allow for $n symbols to be longer than the constants they replace.
-	 * Constants must take at least one byte in text form, while a $n symbol
-	 * certainly isn't more than 11 bytes, even if n reaches INT_MAX.  We
-	 * could refine that limit based on the max value of n for the current
-	 * query, but it hardly seems worth any extra effort to do so.
-	 */
-	norm_query_buflen = query_len + jstate->clocations_count * 10;
+	if (text->spilled)
+	{
+		pgssQueryHdr	hdr;
+
+		/* The file may have grown since it was mapped */
+		if (qfile == NULL || text->pos + sizeof (pgssQueryHdr) + text->len > qfile_size)
+			return NULL;
+
+		/* A record still being written reads as zeros */
+		memcpy(&hdr, &qfile[text->pos], sizeof (pgssQueryHdr));
+		if (memcmp(&hdr.key, &key, sizeof(pgssTextHashKey)) != 0 ||
+			hdr.len != text->len)
+			return NULL;
+		src = (unsigned char *) &qfile[text->pos + sizeof (pgssQueryHdr)];
+	}
+	else
+	{
+		pgssQueryHdr	hdr;
+		uint64			off = QBUF_OFFSET(text->pos);
+
+		/* Records never wrap, but check we are looking at the right one */
+		if (off + sizeof (pgssQueryHdr) + text->len > query_buf_size)
+			return NULL;
+		memcpy(&hdr, &pgss_qbuf[off], sizeof (pgssQueryHdr));
+		if (memcmp(&hdr.key, &key, sizeof(pgssTextHashKey)) != 0 ||
+			hdr.len != text->len)
+			return NULL;
+		src = &pgss_qbuf[off + sizeof (pgssQueryHdr)];
+	}
 
-	/* Allocate result buffer */
-	norm_query = palloc(norm_query_buflen + 1);
+	result = (struct varlena *) palloc(VARHDRSZ + text->raw_len);
+	SET_VARSIZE(result, VARHDRSZ + text->raw_len);
+	if (!read_query_text(src, text->len, text->raw_len, VARDATA(result)))
+	{
+		pfree(result);
+		return NULL;
+	}
 
-	for (i = 0; i < jstate->clocations_count; i++)
+	/* Texts were validated when stored, only convert if really needed */
+	if (encoding != GetDatabaseEncoding())
 	{
-		int			off,		/* Offset from start for cur tok */
-					tok_len;	/* Length (in bytes) of that tok */
+		char	*enc = pg_any_to_server(VARDATA(result), text->raw_len, encoding);
 
-		off = jstate->clocations[i].location;
-		/* Adjust recorded location if we're dealing with partial string */
-		off -= query_loc;
+		if (enc != VARDATA(result))
+		{
+			pfree(result);
+			result = (struct varlena *) cstring_to_text(enc);
+			pfree(enc);
+		}
+	}
+	return result;
+}
 
-		tok_len = jstate->clocations[i].length;
+/*
+ * Add the text of a query to the text store, on behalf of a bucket.  Each
+ * distinct text is stored once, whatever the number of buckets using it.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+store_query(uint64 bucket_id, pgssTextKind kind, uint64 id, const char *query, uint64 query_len)
+{
+	pgssTextHashKey	key;
+	pgssTextEntry	*text;
+	pgssQueryHdr	hdr;
+	char			*cbuf = NULL;
+	const char		*data;
+	int64			pos;
+	bool			spilled = false;
+	bool			found;
 
-		if (tok_len < 0)
-			continue;			/* ignore any duplicates */
+	if (query_len > PGSM_QUERY_MAX_LEN)
+		query_len = PGSM_QUERY_MAX_LEN;
+	if (query_len == 0)
+		return;
 
-		/* Copy next chunk (what precedes the next constant) */
-		len_to_wrt = off - last_off;
-		len_to_wrt -= last_tok_len;
+	/* Someone else may have stored it while we waited for the lock */
+	memset(&key, 0, sizeof(pgssTextHashKey));
+	key.id = id;
+	key.kind = kind;
+	text = (pgssTextEntry *) hash_search(pgss_texthash, &key, HASH_FIND, NULL);
+	if (text)
+	{
+		pg_atomic_fetch_or_u32(&text->refs, (uint32) 1 << bucket_id);
+		return;
+	}
 
-		Assert(len_to_wrt >= 0);
-		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-		n_quer_loc += len_to_wrt;
+	memset(&hdr, 0, sizeof(pgssQueryHdr));
+	memcpy(&hdr.key, &key, sizeof(pgssTextHashKey));
+	hdr.raw_len = query_len;
+	hdr.len = query_len;
 
-		/* And insert a param symbol in place of the constant token */
-		n_quer_loc += sprintf(norm_query + n_quer_loc, "$%d",
-							  i + 1 + jstate->highest_extern_param_id);
+	/* Keep the compressed form only if it actually saves space */
+	if (query_len >= QUERY_COMPRESS_MIN_LEN)
+	{
+		int32	clen;
 
-		quer_loc = off + tok_len;
-		last_off = off;
-		last_tok_len = tok_len;
+		cbuf = palloc(QUERY_COMPRESS_BOUND(query_len));
+		clen = compress_query_text(query, query_len, cbuf);
+		if (clen > 0 && clen < query_len)
+			hdr.len = clen;
 	}
 
-	/*
-	 * We've copied up until the last ignorable constant.  Copy over the
-	 * remaining bytes of the original query string.
-	 */
-	len_to_wrt = query_len - quer_loc;
-
-	Assert(len_to_wrt >= 0);
-	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-	n_quer_loc += len_to_wrt;
+	data = (hdr.len == hdr.raw_len) ? query : cbuf;
+	pos = qbuf_append(&hdr, data);
 
-	Assert(n_quer_loc <= norm_query_buflen);
-	norm_query[n_quer_loc] = '\0';
+	/* Too long for the buffer, go straight to the query file */
+	if (pos < 0)
+	{
+		pos = qtext_spill(&hdr, data);
+		spilled = true;
+	}
+	if (cbuf)
+		pfree(cbuf);
 
-	*query_len_p = n_quer_loc;
-	return norm_query;
+	/* Without an entry, the record is garbage the tail will skip over */
+	text = (pgssTextEntry *) hash_search(pgss_texthash, &key, HASH_ENTER_NULL, &found);
+	if (text == NULL)
+	{
+		if (spilled)
+			pgss->spill_garbage += sizeof (pgssQueryHdr) + hdr.len;
+		pg_atomic_fetch_add_u64(&pgss->qbuf_stats.dropped, 1);
+		return;
+	}
+	text->pos = pos;
+	text->len = hdr.len;
+	text->raw_len = hdr.raw_len;
+	text->spilled = spilled;
+	pg_atomic_init_u32(&text->refs, (uint32) 1 << bucket_id);
+
+	pg_atomic_fetch_add_u64(&pgss->qbuf_stats.raw_bytes, hdr.raw_len);
+	pg_atomic_fetch_add_u64(&pgss->qbuf_stats.stored_bytes, hdr.len);
 }
 
 /*
- * Given a valid SQL string and an array of constant-location records,
- * fill in the textual lengths of those constants.
- *
- * The constants may use any allowed constant syntax, such as float literals,
- * bit-strings, single-quoted strings and dollar-quoted strings.  This is
- * accomplished by using the public API for the core scanner.
- *
- * It is the caller's job to ensure that the string is a valid SQL statement
- * with constants at the indicated locations.  Since in practice the string
- * has already been parsed, and the locations that the caller provides will
- * have originated from within the authoritative parser, this should not be
- * a problem.
- *
- * Duplicate constant pointers are possible, and will have their lengths
- * marked as '-1', so that they are later ignored.  (Actually, we assume the
- * lengths were initialized as -1 to start with, and don't change them here.)
+ * Drop the reference of a bucket on a text, removing the text if no other
+ * bucket uses it.
  *
- * If query_loc > 0, then "query" has been advanced by that much compared to
- * the original string start, so we need to translate the provided locations
- * to compensate.  (This lets us avoid re-scanning statements before the one
- * of interest, so it's worth doing.)
- *
- * N.B. There is an assumption that a '-' character at a Const location begins
- * a negative numeric constant.  This precludes there ever being another
- * reason for a constant to start with a '-'.
+ * Caller must hold an exclusive lock on pgss->lock.
  */
 static void
-fill_in_constant_lengths(pgssJumbleState *jstate, const char *query,
-						 int query_loc)
+query_text_unref(uint64 bucket_id, pgssTextKind kind, uint64 id)
 {
-	pgssLocationLen		*locs;
-	core_yyscan_t		yyscanner;
-	core_yy_extra_type	yyextra;
-	core_YYSTYPE		yylval;
-	YYLTYPE				yylloc;
-	int					last_loc = -1;
-	int					i;
-
-	/*
-	 * Sort the records by location so that we can process them in order while
-	 * scanning the query text.
-	 */
-	if (jstate->clocations_count > 1)
-		qsort(jstate->clocations, jstate->clocations_count,
-			  sizeof(pgssLocationLen), comp_location);
-	locs = jstate->clocations;
+	pgssTextHashKey	key;
+	pgssTextEntry	*text;
+	uint32			bit = (uint32) 1 << bucket_id;
 
-	/* initialize the flex scanner --- should match raw_parser() */
-	yyscanner = scanner_init(query,
-							 &yyextra,
-#if PG_VERSION_NUM >= 120000
-							&ScanKeywords,
-							ScanKeywordTokens);
-#else
-							ScanKeywords,
-							NumScanKeywords);
-#endif
-	/* we don't want to re-emit any escape string warnings */
-	yyextra.escape_string_warning = false;
+	memset(&key, 0, sizeof(pgssTextHashKey));
+	key.id = id;
+	key.kind = kind;
+	text = (pgssTextEntry *) hash_search(pgss_texthash, &key, HASH_FIND, NULL);
+	if (text == NULL)
+		return;
+	if ((pg_atomic_fetch_and_u32(&text->refs, ~bit) & ~bit) == 0)
+		query_text_remove(text);
+}
 
-	/* Search for each constant, in sequence */
-	for (i = 0; i < jstate->clocations_count; i++)
+/*
+ * Remove a text no bucket uses any more.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+query_text_remove(pgssTextEntry *text)
+{
+	if (text->spilled)
+		pgss->spill_garbage += sizeof (pgssQueryHdr) + text->len;
+	pg_atomic_fetch_sub_u64(&pgss->qbuf_stats.raw_bytes, text->raw_len);
+	pg_atomic_fetch_sub_u64(&pgss->qbuf_stats.stored_bytes, text->len);
+	hash_search(pgss_texthash, &text->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Drop the references of an expiring bucket (all buckets if bucket < 0) on
+ * the text store.  Texts no longer referenced are removed from the hash;
+ * their space is reclaimed once the tail of pgss_qbuf passes them.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+query_text_release(int bucket)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	pgssTextEntry	*text;
+
+	hash_seq_init(&hash_seq, pgss_texthash);
+	while ((text = hash_seq_search(&hash_seq)) != NULL)
 	{
-		int			loc = locs[i].location;
-		int			tok;
+		if (bucket >= 0 &&
+			(pg_atomic_fetch_and_u32(&text->refs, ~((uint32) 1 << bucket)) & ~((uint32) 1 << bucket)) != 0)
+			continue;
+		query_text_remove(text);
+	}
 
-		/* Adjust recorded location if we're dealing with partial string */
-		loc -= query_loc;
+	if (bucket < 0)
+		pgss->query_fifo.head = pgss->query_fifo.tail = 0;
 
-		Assert(loc >= 0);
+	qtext_gc_if_needed();
+}
 
-		if (loc <= last_loc)
-			continue;			/* Duplicate constant, ignore */
+/*
+ * Compact the query file once half of it is garbage.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+qtext_gc_if_needed(void)
+{
+	if (pgss->spill_garbage > 0 && pgss->spill_garbage >= pgss->extent / 2)
+		qtext_gc();
+}
 
-		/* Lex tokens until we find the desired constant */
-		for (;;)
-		{
-			tok = core_yylex(&yylval, &yylloc, yyscanner);
+/*
+ * pgss_qbuf is a log of text records, each a pgssQueryHdr followed by the
+ * text.  head and tail are ever-increasing positions, the offset in the
+ * buffer being the position modulo its size.  A record never straddles the
+ * end of the buffer: the space left there is skipped, with a header of
+ * zero length marking the skip when it has room for one.
+ */
 
-			/* We should not hit end-of-string, but if we do, behave sanely */
-			if (tok == 0)
-				break;			/* out of inner for-loop */
+/*
+ * Advance the tail until there is room for need bytes.  Records whose text
+ * has been released are simply skipped; texts still in use are moved to the
+ * query file, see qtext_spill().
+ */
+static void
+qbuf_reclaim(uint64 need)
+{
+	QueryFifo	*fifo = &pgss->query_fifo;
 
-			/*
-			 * We should find the token position exactly, but if we somehow
-			 * run past it, work with that.
-			 */
-			if (yylloc >= loc)
-			{
-				if (query[loc] == '-')
-				{
-					/*
-					 * It's a negative value - this is the one and only case
-					 * where we replace more than a single token.
-					 *
-					 * Do not compensate for the core system's special-case
-					 * adjustment of location to that of the leading '-'
-					 * operator in the event of a negative constant.  It is
-					 * also useful for our purposes to start from the minus
-					 * symbol.  In this way, queries like "select * from foo
-					 * where bar = 1" and "select * from foo where bar = -2"
-					 * will have identical normalized query strings.
-					 */
-					tok = core_yylex(&yylval, &yylloc, yyscanner);
-					if (tok == 0)
-						break;	/* out of inner for-loop */
-				}
+	while (fifo->head - fifo->tail + need > query_buf_size)
+	{
+		uint64			off = QBUF_OFFSET(fifo->tail);
+		pgssQueryHdr	hdr;
+		pgssTextEntry	*text;
 
-				/*
-				 * We now rely on the assumption that flex has placed a zero
-				 * byte after the text of the current token in scanbuf.
-				 */
-				locs[i].length = strlen(yyextra.scanbuf + loc);
-				break;			/* out of inner for-loop */
-			}
+		if (query_buf_size - off < sizeof (pgssQueryHdr))
+		{
+			fifo->tail += query_buf_size - off;
+			continue;
 		}
 
-		/* If we hit end-of-string, give up, leaving remaining lengths -1 */
-		if (tok == 0)
-			break;
+		memcpy(&hdr, &pgss_qbuf[off], sizeof (pgssQueryHdr));
+		if (hdr.len == 0)
+		{
+			fifo->tail += query_buf_size - off;
+			continue;
+		}
 
-		last_loc = loc;
+		text = (pgssTextEntry *) hash_search(pgss_texthash, &hdr.key, HASH_FIND, NULL);
+		if (text && !text->spilled && text->pos == fifo->tail)
+		{
+			text->pos = qtext_spill(&hdr, (const char *) &pgss_qbuf[off + sizeof (pgssQueryHdr)]);
+			text->spilled = true;
+			pg_atomic_fetch_add_u64(&pgss->qbuf_stats.evicted, 1);
+		}
+		fifo->tail += sizeof (pgssQueryHdr) + hdr.len;
 	}
-
-	scanner_finish(yyscanner);
 }
 
 /*
- * comp_location: comparator for qsorting pgssLocationLen structs by location
+ * Append a record to pgss_qbuf and return its position, or -1 if there is
+ * no room for it.
  */
-static int
-comp_location(const void *a, const void *b)
+static int64
+qbuf_append(pgssQueryHdr *hdr, const char *text)
 {
-	int	l = ((const pgssLocationLen *) a)->location;
-	int	r = ((const pgssLocationLen *) b)->location;
+	QueryFifo	*fifo = &pgss->query_fifo;
+	uint64		need = sizeof (pgssQueryHdr) + hdr->len;
+	uint64		off = QBUF_OFFSET(fifo->head);
+	uint64		skip = 0;
+	uint64		pos;
 
-	if (l < r)
+	if (need > query_buf_size)
 		return -1;
-	else if (l > r)
-		return +1;
-	else
-		return 0;
-}
 
-/* Convert array into Text dataum */
-static Datum
-array_get_datum(int arr[])
-{
-	int     j;
-	char    str[1024] = {0};
-	char    tmp[10];
-	bool    first = true;
+	if (off + need > query_buf_size)
+		skip = query_buf_size - off;
+
+	qbuf_reclaim(skip + need);
 
-	memset(str, 0, 1024);
-	/* Need to calculate the actual size, and avoid unnessary memory usage */
-	for (j = 0; j < 10; j++)
+	if (skip > 0)
 	{
-		if (first)
+		if (skip >= sizeof (pgssQueryHdr))
 		{
-			snprintf(tmp, 10, "%d", arr[j]);
-			strcat(str,tmp);
-			first = false;
-			continue;
+			pgssQueryHdr	mark;
+
+			memset(&mark, 0, sizeof (pgssQueryHdr));
+			memcpy(&pgss_qbuf[off], &mark, sizeof (pgssQueryHdr));
 		}
-		snprintf(tmp, 10, ", %d", arr[j]);
-		strcat(str,tmp);
+		fifo->head += skip;
+		off = 0;
 	}
-	return CStringGetTextDatum(str);
+
+	memcpy(&pgss_qbuf[off], hdr, sizeof (pgssQueryHdr));
+	memcpy(&pgss_qbuf[off + sizeof (pgssQueryHdr)], text, hdr->len);
+
+	pos = fifo->head;
+	fifo->head += need;
+	return pos;
 }
 
-/* Alocate memory for a new entry */
-void add_object_entry(uint64 queryid, char *objects)
+/*
+ * Move a record to the query file, for texts that do not fit in pgss_qbuf,
+ * and return its offset there.  Only the space is reserved here; the record
+ * is queued and written by qtext_flush() once pgss->lock is released, so
+ * that other backends don't wait for file I/O.  Until then readers find a
+ * hole or a short file, which fails the header check in locate_query().
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
+static Size
+qtext_spill(pgssQueryHdr *hdr, const char *text)
 {
-	pgssObjectEntry	*entry = NULL;
-	bool			found;
-	pgssObjectHashKey key;
+	Size	off;
 
-	key.queryid = queryid;
-	entry = (pgssObjectEntry *) hash_search(pgss_object_hash, &key, HASH_ENTER, &found);
-	if (!found)
+	if (qtext_pending == NULL)
 	{
-		SpinLockAcquire(&entry->mutex);
-		snprintf(entry->tables_name, MAX_REL_LEN, "%s", objects);
-		SpinLockRelease(&entry->mutex);
+		MemoryContext	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+		qtext_pending = makeStringInfo();
+		MemoryContextSwitchTo(oldcxt);
+		before_shmem_exit(qtext_shmem_exit, (Datum) 0);
+	}
+
+	SpinLockAcquire(&pgss->mutex);
+	off = pgss->extent;
+	SpinLockRelease(&pgss->mutex);
+
+	/*
+	 * Records queued under one lock hold are contiguous.  Leftovers from a
+	 * call that errored out before flushing are not, so write them first.
+	 */
+	if (qtext_pending->len > 0 && qtext_pending_off + qtext_pending->len != off)
+		qtext_flush();
+
+	if (qtext_pending->len == 0)
+	{
+		qtext_pending_off = off;
+		SpinLockAcquire(&pgss->mutex);
+		pgss->n_writers++;
+		SpinLockRelease(&pgss->mutex);
 	}
+	appendBinaryStringInfo(qtext_pending, (const char *) hdr, sizeof (pgssQueryHdr));
+	appendBinaryStringInfo(qtext_pending, text, hdr->len);
+
+	SpinLockAcquire(&pgss->mutex);
+	pgss->extent = off + sizeof (pgssQueryHdr) + hdr->len;
+	SpinLockRelease(&pgss->mutex);
+
+	return off;
 }
 
-/* Alocate memory for a new entry */
-static pgssAggEntry *
-agg_entry_alloc(pgssAggHashKey *key)
+/*
+ * Write the records queued by qtext_spill().  Called after releasing
+ * pgss->lock; the file is not compacted while there are pending writers.
+ */
+static void
+qtext_flush(void)
 {
-	pgssAggEntry	*entry = NULL;
-	bool			found;
+	int		fd;
 
-	entry = (pgssAggEntry *) hash_search(pgss_agghash, key, HASH_ENTER, &found);
-	if (!found)
+	if (qtext_pending == NULL || qtext_pending->len == 0)
+		return;
+
+	fd = OpenTransientFile(PGSM_TEXT_FILE, O_RDWR | O_CREAT | PG_BINARY);
+	if (fd < 0 ||
+		lseek(fd, qtext_pending_off, SEEK_SET) != (off_t) qtext_pending_off ||
+		write(fd, qtext_pending->data, qtext_pending->len) != qtext_pending->len)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_stat_monitor: could not write file \"%s\": %m",
+						PGSM_TEXT_FILE)));
+	if (fd >= 0)
+		CloseTransientFile(fd);
+
+	resetStringInfo(qtext_pending);
+	SpinLockAcquire(&pgss->mutex);
+	pgss->n_writers--;
+	SpinLockRelease(&pgss->mutex);
+}
+
+/*
+ * A backend exiting with records queued would leave their space unwritten,
+ * and the query file never compacted again.
+ */
+static void
+qtext_shmem_exit(int code, Datum arg)
+{
+	qtext_flush();
+}
+
+/*
+ * Map the query file for reading.  Returns NULL if there is nothing spilled
+ * or the file cannot be mapped; the caller must munmap() the result.
+ *
+ * Caller must hold a lock on pgss->lock, so that the file is not compacted
+ * while mapped.
+ */
+static char *
+qtext_map(Size *size)
+{
+	Size		extent;
+	char		*buf;
+	int			fd;
+	struct stat	st;
+
+	SpinLockAcquire(&pgss->mutex);
+	extent = pgss->extent;
+	SpinLockRelease(&pgss->mutex);
+
+	if (extent == 0)
+		return NULL;
+
+	fd = OpenTransientFile(PGSM_TEXT_FILE, O_RDONLY | PG_BINARY);
+	if (fd < 0)
 	{
-		SpinLockAcquire(&entry->mutex);
-		memset(&entry->counters, 0, sizeof(pgssAggCounters));
-		entry->counters.total_calls = 0;
-		SpinLockRelease(&entry->mutex);
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_stat_monitor: could not open file \"%s\": %m",
+						PGSM_TEXT_FILE)));
+		return NULL;
 	}
-	return entry;
+
+	/* Records still being written may lie past the end of the file */
+	if (fstat(fd, &st) == 0 && (Size) st.st_size < extent)
+		extent = st.st_size;
+	if (extent == 0)
+	{
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	buf = mmap(NULL, extent, PROT_READ, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (buf == MAP_FAILED)
+	{
+		ereport(LOG,
+				(errmsg("pg_stat_monitor: could not map file \"%s\": %m",
+						PGSM_TEXT_FILE)));
+		return NULL;
+	}
+
+	*size = extent;
+	return buf;
 }
 
+/*
+ * Rewrite the query file with only the texts still referenced, or remove it
+ * if there are none left.  The texts keep pointing into the old file until
+ * the new one has replaced it, so a failure at any step loses nothing.
+ *
+ * Caller must hold an exclusive lock on pgss->lock.
+ */
 static void
-update_agg_counters(uint64 bucket, uint64 queryid, uint64 id, AGG_KEY type)
+qtext_gc(void)
 {
-	pgssAggHashKey	key;
-	pgssAggEntry	*entry;
+	HASH_SEQ_STATUS	hash_seq;
+	pgssTextEntry	*text;
+	pgssTextEntry	**moved = NULL;
+	uint64			*moved_pos = NULL;
+	int				nmoved = 0;
+	int				i;
+	char			*qfile;
+	Size			qfile_size = 0;
+	Size			extent = 0;
+	FILE			*file = NULL;
+	char			tmpfile[MAXPGPATH];
+	int				writers;
+
+	/* Records reserved but not written yet would be lost; retry later */
+	SpinLockAcquire(&pgss->mutex);
+	writers = pgss->n_writers;
+	SpinLockRelease(&pgss->mutex);
+	if (writers > 0)
+		return;
 
-	key.id = id;
-	key.type = (int64) type;
-	key.queryid = queryid;
-	key.bucket_id = bucket;
+	if (pgss->spill_garbage >= pgss->extent)
+	{
+		unlink(PGSM_TEXT_FILE);
+		goto done;
+	}
 
-	entry = agg_entry_alloc(&key);
-	if (!entry)
+	qfile = qtext_map(&qfile_size);
+	if (qfile == NULL)
 		return;
 
-	SpinLockAcquire(&entry->mutex);
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", PGSM_TEXT_FILE);
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	moved = palloc(hash_get_num_entries(pgss_texthash) * sizeof(pgssTextEntry *));
+	moved_pos = palloc(hash_get_num_entries(pgss_texthash) * sizeof(uint64));
 
-	entry->key.queryid = queryid;
-	entry->key.id = id;
-	entry->key.type = key.type;
-	entry->key.bucket_id = bucket;
+	hash_seq_init(&hash_seq, pgss_texthash);
+	while ((text = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Size			len = sizeof (pgssQueryHdr) + text->len;
+		pgssQueryHdr	hdr;
+
+		if (!text->spilled)
+			continue;
+
+		/*
+		 * A record whose write failed is lost; forget the text so that it
+		 * is stored again the next time the query runs.
+		 */
+		memset(&hdr, 0, sizeof (pgssQueryHdr));
+		if (text->pos + len <= qfile_size)
+			memcpy(&hdr, &qfile[text->pos], sizeof (pgssQueryHdr));
+		if (memcmp(&hdr.key, &text->key, sizeof(pgssTextHashKey)) != 0 ||
+			hdr.len != text->len)
+		{
+			pg_atomic_fetch_sub_u64(&pgss->qbuf_stats.raw_bytes, text->raw_len);
+			pg_atomic_fetch_sub_u64(&pgss->qbuf_stats.stored_bytes, text->len);
+			hash_search(pgss_texthash, &text->key, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		if (fwrite(&qfile[text->pos], 1, len, file) != len)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+		moved[nmoved] = text;
+		moved_pos[nmoved++] = extent;
+		extent += len;
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+	file = NULL;
 
-	entry->counters.total_calls++;
-	SpinLockRelease(&entry->mutex);
+	if (rename(tmpfile, PGSM_TEXT_FILE) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pg_stat_monitor: could not rename file \"%s\": %m",
+						tmpfile)));
+		goto cleanup;
+	}
+	munmap(qfile, qfile_size);
+
+	for (i = 0; i < nmoved; i++)
+		moved[i]->pos = moved_pos[i];
+	pfree(moved);
+	pfree(moved_pos);
+
+done:
+	SpinLockAcquire(&pgss->mutex);
+	pgss->extent = extent;
+	pgss->spill_garbage = 0;
+	pgss->qfile_generation++;
+	SpinLockRelease(&pgss->mutex);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("pg_stat_monitor: could not write file \"%s\": %m",
+					tmpfile)));
+cleanup:
+	if (file)
+		FreeFile(file);
+	unlink(tmpfile);
+	munmap(qfile, qfile_size);
+	if (moved)
+		pfree(moved);
+	if (moved_pos)
+		pfree(moved_pos);
+}
+
+/*
+ * Compress a query text into dest, which must have room for
+ * QUERY_COMPRESS_BOUND(len) bytes.  Returns the compressed length, or a
+ * value <= 0 if the text is not compressible.
+ */
+static int32
+compress_query_text(const char *query, int32 len, char *dest)
+{
+#ifdef USE_LZ4
+	return LZ4_compress_default(query, dest, len, QUERY_COMPRESS_BOUND(len));
+#else
+	return pglz_compress(query, len, dest, PGLZ_strategy_default);
+#endif
+}
+
+/*
+ * Copy a query text out of the shared buffer into query, decompressing it
+ * if needed.  query must have room for raw_len bytes; it is not
+ * null-terminated.
+ */
+static bool
+read_query_text(const unsigned char *src, uint32 len, uint32 raw_len, char *query)
+{
+	if (len == raw_len)
+		memcpy(query, src, len);
+	else
+	{
+#ifdef USE_LZ4
+		if (LZ4_decompress_safe((const char *) src, query, len, raw_len) != raw_len)
+			return false;
+#elif PG_VERSION_NUM >= 120000
+		if (pglz_decompress((const char *) src, len, query, raw_len, true) != raw_len)
+			return false;
+#else
+		if (pglz_decompress((const char *) src, len, query, raw_len) != raw_len)
+			return false;
+#endif
+	}
+	return true;
 }
 
 Datum
-pg_stat_agg(PG_FUNCTION_ARGS)
+pg_stat_monitor_query_buffer(PG_FUNCTION_ARGS)
 {
 	ReturnSetInfo		*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc			tupdesc;
@@ -2506,26 +4948,25 @@ pg_stat_agg(PG_FUNCTION_ARGS)
 	MemoryContext		per_query_ctx;
 	MemoryContext		oldcontext;
 	HASH_SEQ_STATUS		hash_seq;
-	pgssAggEntry		*entry;
-
-	/* hash table must exist already */
-	if (!pgss || !pgss_agghash)
+	pgssTextEntry		*text;
+	Datum				values[10];
+	bool				nulls[10];
+	int					j = 0;
+	int64				texts = 0;
+	int64				spilled = 0;
+	int64				references = 0;
+
+	/* shared state must exist already */
+	if (!pgss || !pgss_texthash)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("pg_stat_monitor: must be loaded via shared_preload_libraries")));
 
-	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
 		ereport(ERROR,
 				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 				 errmsg("pg_stat_monitor: set-valued function called in context that cannot accept a set")));
 
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("pg_stat_monitor: materialize mode required, but it is not " \
-						"allowed in this context")));
-
 	/* Switch into long-lived context to construct returned data structures */
 	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
 	oldcontext = MemoryContextSwitchTo(per_query_ctx);
@@ -2534,231 +4975,374 @@ pg_stat_agg(PG_FUNCTION_ARGS)
 	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "pg_stat_monitor: return type must be a row type");
 
-	if (tupdesc->natts != 4)
+	if (tupdesc->natts != 10)
 		elog(ERROR, "pg_stat_monitor: incorrect number of output arguments, required %d", tupdesc->natts);
 
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
-
-	MemoryContextSwitchTo(oldcontext);
-
-	/*
-	 * Get shared lock, load or reload the query text file if we must, and
-	 * iterate over the hashtable entries.
-	 *
-	 * With a large hash table, we might be holding the lock rather longer
-	 * than one could wish.  However, this only blocks creation of new hash
-	 * table entries, and the larger the hash table the less likely that is to
-	 * be needed.  So we can hope this is okay.  Perhaps someday we'll decide
-	 * we need to partition the hash table to limit the time spent holding any
-	 * one lock.
-	 */
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
 	LWLockAcquire(pgss->lock, LW_SHARED);
-	hash_seq_init(&hash_seq, pgss_agghash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	hash_seq_init(&hash_seq, pgss_texthash);
+	while ((text = hash_seq_search(&hash_seq)) != NULL)
 	{
-		Datum		values[6];
-		bool		nulls[6];
-		int			i = 0;
-		char		queryid_txt[32];
-
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+		uint32	refs = pg_atomic_read_u32(&text->refs);
 
-		sprintf(queryid_txt, "%08lX", entry->key.queryid);
-		values[i++] = CStringGetTextDatum(queryid_txt);
-		values[i++] = Int64GetDatumFast(entry->key.id);
-		values[i++] = Int64GetDatumFast(entry->key.type);
-		values[i++] = Int64GetDatumFast(entry->counters.total_calls);
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		texts++;
+		if (text->spilled)
+			spilled++;
+		for (; refs != 0; refs &= refs - 1)
+			references++;
 	}
 
-	/* clean up and return the tuplestore */
+	values[j++] = Int64GetDatum((int64) query_buf_size);
+	values[j++] = Int64GetDatum((int64) (pgss->query_fifo.head - pgss->query_fifo.tail));
+	values[j++] = Int64GetDatumFast(texts);
+	values[j++] = Int64GetDatumFast(references);
+	values[j++] = Int64GetDatumFast(spilled);
+	values[j++] = Int64GetDatum((int64) pgss->extent);
+	values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgss->qbuf_stats.raw_bytes));
+	values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgss->qbuf_stats.stored_bytes));
+	values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgss->qbuf_stats.evicted));
+	values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgss->qbuf_stats.dropped));
 	LWLockRelease(pgss->lock);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	/* clean up and return the tuplestore */
 	tuplestore_donestoring(tupstore);
-	return 0;
+	return (Datum) 0;
 }
 
-#define FIFO_HEAD(b) pgss->query_fifo[b].head
-#define FIFO_TAIL(b) pgss->query_fifo[b].tail
-
-static uint64
-locate_query(uint64 bucket_id, uint64 queryid, char * query)
+#if PG_VERSION_NUM >= 130000
+static PlannedStmt * pgss_planner_hook(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
+#else
+static PlannedStmt *pgss_planner_hook(Query *parse, int opt, ParamListInfo param)
+#endif
 {
-	uint64 id = 0;
-	uint64 len = 0;
-	uint64 offset = 0;
-	uint64 tail = FIFO_TAIL(bucket_id);
-	unsigned char *buf = pgss_qbuf[bucket_id];
+	PlannedStmt *result;
+	uint64		prev_queryid;
+	instr_time	plan_start;
+	instr_time	plan_duration;
+	ParamListInfo params;
 
-	while (FIFO_HEAD(bucket_id) != tail)
+	/* Waits while planning belong to the statement being planned */
+	prev_queryid = pgsm_publish_queryid(parse->queryId);
+	PG_TRY();
 	{
-		offset = 0;
-		memcpy(&id, &buf[tail + offset], sizeof (uint64)); /* query id */
+		INSTR_TIME_SET_CURRENT(plan_start);
+#if PG_VERSION_NUM >= 130000
+		if (PGSM_TRACK_PLANNING && query_string
+			&& parse->queryId != UINT64CONST(0))
+		{
+			instr_time	start;
+			instr_time	duration;
+			BufferUsage bufusage_start,
+						bufusage;
+			WalUsage	walusage_start,
+						walusage;
 
-		offset += sizeof (uint64);
-		memcpy(&len, &buf[tail + offset], sizeof (uint64)); /* query len */
+			/* We need to track buffer usage as the planner can access them. */
+			bufusage_start = pgBufferUsage;
 
-		if (len  == 0)
-			return 0;
+			/*
+			 * Similarly the planner could write some WAL records in some cases
+			 * (e.g. setting a hint bit with those being WAL-logged)
+			 */
+			walusage_start = pgWalUsage;
+			INSTR_TIME_SET_CURRENT(start);
 
-		offset += sizeof (uint64);
-		if (query != NULL)
+			plan_nested_level++;
+			PG_TRY();
+			{
+				/* The planning time includes the planners chained after us */
+				if (planner_hook_next)
+					result = planner_hook_next(parse, query_string, cursorOptions, boundParams);
+				else
+					result = standard_planner(parse, query_string, cursorOptions, boundParams);
+			}
+			PG_FINALLY();
+			{
+				plan_nested_level--;
+			}
+			PG_END_TRY();
+
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start);
+
+			/* calc differences of buffer counters. */
+			memset(&bufusage, 0, sizeof(BufferUsage));
+			BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+
+			/* calc differences of WAL counters. */
+			memset(&walusage, 0, sizeof(WalUsage));
+			WalUsageAccumDiff(&walusage, &pgWalUsage, &walusage_start);
+			pgss_store(query_string,
+					   parse->queryId,
+					   parse->stmt_location,
+					   parse->stmt_len,
+					   PGSS_PLAN,
+					   INSTR_TIME_GET_MILLISEC(duration),
+					   0,
+					   1.0,
+					   &bufusage,
+					   &walusage,
+					   NULL,
+					   0,
+					   0,
+					   PGSM_PLAN_NONE,
+					   0);
+		}
+		else
 		{
-			memcpy(query, &buf[tail + offset], len); /* Actual query */
-			query[len] = 0;
+			if (planner_hook_next)
+				result = planner_hook_next(parse, query_string, cursorOptions, boundParams);
+			else
+				result = standard_planner(parse, query_string, cursorOptions, boundParams);
 		}
-		offset += len;
+#else
+		if (planner_hook_next)
+			result = planner_hook_next(parse, opt, param);
+		else
+			result = standard_planner(parse, opt, param);
+#endif
 
-		if (id == queryid)
-			return id;
-		tail = (tail + offset) % query_buf_size_bucket;
+		/*
+		 * The plan cache plans with parameter values only for custom plans, and
+		 * without them for generic plans and statements that have no parameter.
+		 */
+#if PG_VERSION_NUM >= 130000
+		params = boundParams;
+#else
+		params = param;
+#endif
+		if (parse->queryId != UINT64CONST(0))
+		{
+			INSTR_TIME_SET_CURRENT(plan_duration);
+			INSTR_TIME_SUBTRACT(plan_duration, plan_start);
+			remember_plan(result, params != NULL && params->numParams > 0,
+						  INSTR_TIME_GET_MILLISEC(plan_duration));
+		}
 	}
-	return 0;
+#if PG_VERSION_NUM >= 130000
+	PG_FINALLY();
+	{
+		pgsm_publish_queryid(prev_queryid);
+	}
+#else
+	PG_CATCH();
+	{
+		pgsm_publish_queryid(prev_queryid);
+		PG_RE_THROW();
+	}
+#endif
+	PG_END_TRY();
+#if PG_VERSION_NUM < 130000
+	pgsm_publish_queryid(prev_queryid);
+#endif
+	return result;
 }
 
-static void
-store_query(uint64 queryid, const char *query, uint64 query_len)
+/*
+ * Take one sample of the wait events of all the backends, and charge the
+ * elapsed time (in microseconds) since the previous sample to the wait
+ * profile of the query each backend is running.
+ *
+ * ProcArrayLock is not taken: pid and wait_event_info are each a single
+ * aligned read, and like pg_stat_activity we tolerate a sample that is
+ * slightly inconsistent.  A slot whose pid changed while it was being read
+ * is skipped.
+ *
+ * Only every step-th slot, starting from first, is sampled.  Returns the
+ * number of backends found running a query.
+ */
+static int
+update_wait_event(uint64 elapsed, int first, int step)
 {
-    int 	next;
-	int 	offset = 0;
-
-	if (query_len > PGSM_QUERY_MAX_LEN)
-		query_len = PGSM_QUERY_MAX_LEN;
-
-	/* Already have query in the shared buffer, there
-	 * is no need to add that again.
-	 */
-	if (locate_query(pgss->current_wbucket, queryid, NULL) == queryid)
-		return;
+	PGPROC	*proc = NULL;
+	pgssWaitProfileKey	*keys;
+	pgssHashKey			*stmts;
+	uint64	bucket_id = pgss->current_wbucket;
+	int		nslots = (ProcGlobal->allProcCount + step - 1) / step;
+	int		nkeys = 0;
+	int 	i;
 
-	next = FIFO_HEAD(pgss->current_wbucket) + query_len + sizeof (uint64) + sizeof (uint64);
-    if (next >= query_buf_size_bucket)
-        next = 0;
+	keys = palloc(sizeof(pgssWaitProfileKey) * Max(nslots, 1));
+	stmts = palloc(sizeof(pgssHashKey) * Max(nslots, 1));
 
-	/* Buffer is full */
-    if (next == FIFO_HEAD(pgss->current_wbucket))
+	for (i = first; i < ProcGlobal->allProcCount; i += step)
     {
-		elog(INFO, "pg_stat_monitor: no space left in shared_buffer");
-		return;
-	}
+		uint32	wait_event_info;
+		uint64	queryid;
+		int		pid;
 
-	offset = 0;
-	memcpy(&pgss_qbuf[pgss->current_wbucket][FIFO_HEAD(pgss->current_wbucket)], &queryid, sizeof (uint64)); /* query id */
-	offset += sizeof (uint64);
+        proc = &ProcGlobal->allProcs[i];
+		pid = *((volatile int *) &proc->pid);
+		if (pid == 0)
+			continue;
 
-	memcpy(&pgss_qbuf[pgss->current_wbucket][FIFO_HEAD(pgss->current_wbucket) + offset], &query_len, sizeof (uint64)); /* query len */
-	offset += sizeof (uint64);
+		pg_read_barrier();
+		wait_event_info = *((volatile uint32 *) &proc->wait_event_info);
+		pg_read_barrier();
+		if (*((volatile int *) &proc->pid) != pid)
+			continue;
 
-	memcpy(&pgss_qbuf[pgss->current_wbucket][FIFO_HEAD(pgss->current_wbucket) + offset], query, query_len); /* actual query */
+		pgssWaitEventEntries[i].wait_event_info = wait_event_info;
+		pgssWaitEventEntries[i].pid = pid;
 
-    pgss->query_fifo[pgss->current_wbucket].head = next;
-}
+		/* An idle backend waits for its client, it is not running a query */
+		queryid = pgssWaitEventEntries[i].queryid;
+		if (queryid == 0 || wait_event_info == WAIT_EVENT_CLIENT_READ)
+			continue;
 
-#if PG_VERSION_NUM >= 130000
-static PlannedStmt * pgss_planner_hook(Query *parse, const char *query_string, int cursorOptions, ParamListInfo boundParams)
-#else
-static PlannedStmt *pgss_planner_hook(Query *parse, int opt, ParamListInfo param)
-#endif
-{
-	PlannedStmt *result;
-    if (MyProc)
-    {
-        int i = MyProc - ProcGlobal->allProcs;
-        if (pgssWaitEventEntries[i]->key.queryid != parse->queryId)
-		    pgssWaitEventEntries[i]->key.queryid = parse->queryId;
+		memset(&keys[nkeys], 0, sizeof(pgssWaitProfileKey));
+		keys[nkeys].bucket_id = bucket_id;
+		keys[nkeys].queryid = queryid;
+		keys[nkeys].wait_event_info = wait_event_info;
+
+		memset(&stmts[nkeys], 0, sizeof(pgssHashKey));
+		stmts[nkeys].bucket_id = bucket_id;
+		stmts[nkeys].queryid = queryid;
+		stmts[nkeys].userid = pgssWaitEventEntries[i].userid;
+		stmts[nkeys].dbid = pgssWaitEventEntries[i].dbid;
+		nkeys++;
 	}
-#if PG_VERSION_NUM >= 130000
-	if (PGSM_TRACK_PLANNING && query_string
-		&& parse->queryId != UINT64CONST(0))
+
+	if (nkeys > 0)
 	{
-		instr_time	start;
-		instr_time	duration;
-		BufferUsage bufusage_start,
-					bufusage;
-		WalUsage	walusage_start,
-					walusage;
+		update_wait_counters(keys, stmts, nkeys, elapsed);
+		update_wait_profile(keys, nkeys, elapsed);
+	}
+	pfree(keys);
+	pfree(stmts);
+	return nkeys;
+}
 
-		/* We need to track buffer usage as the planner can access them. */
-		bufusage_start = pgBufferUsage;
+/*
+ * Charge the elapsed time of the samples to the wait time counters of the
+ * statements in the current bucket.  Samples of a statement that has no
+ * entry yet, i.e. whose first execution is still running, are not counted.
+ */
+static void
+update_wait_counters(pgssWaitProfileKey *keys, pgssHashKey *stmts, int nkeys, uint64 elapsed)
+{
+	double	msec = elapsed / 1000.0;
+	int		i;
 
-		/*
-		 * Similarly the planner could write some WAL records in some cases
-		 * (e.g. setting a hint bit with those being WAL-logged)
-		 */
-		walusage_start = pgWalUsage;
-		INSTR_TIME_SET_CURRENT(start);
+	LWLockAcquire(pgss->lock, LW_SHARED);
+	for (i = 0; i < nkeys; i++)
+	{
+		volatile pgssEntry	*e;
 
-		plan_nested_level++;
-		PG_TRY();
+		switch (keys[i].wait_event_info & 0xFF000000)
 		{
-    		if (planner_hook_next)
-        		result = planner_hook_next(parse, query_string, cursorOptions, boundParams);
-    		result = standard_planner(parse, query_string, cursorOptions, boundParams);
-		}
-		PG_FINALLY();
-		{
-			plan_nested_level--;
+			case PG_WAIT_LOCK:
+			case PG_WAIT_LWLOCK:
+			case PG_WAIT_IO:
+			case PG_WAIT_IPC:
+			case PG_WAIT_CLIENT:
+				break;
+			default:
+				continue;		/* running, or a class we don't count */
 		}
-		PG_END_TRY();
-
-		INSTR_TIME_SET_CURRENT(duration);
-		INSTR_TIME_SUBTRACT(duration, start);
 
-		/* calc differences of buffer counters. */
-		memset(&bufusage, 0, sizeof(BufferUsage));
-		BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+		e = (volatile pgssEntry *) hash_search(pgss_hash, &stmts[i], HASH_FIND, NULL);
+		if (e == NULL)
+			continue;
 
-		/* calc differences of WAL counters. */
-		memset(&walusage, 0, sizeof(WalUsage));
-		WalUsageAccumDiff(&walusage, &pgWalUsage, &walusage_start);
-		pgss_store(query_string,
-				   parse->queryId,
-				   parse->stmt_location,
-				   parse->stmt_len,
-				   PGSS_PLAN,
-				   INSTR_TIME_GET_MILLISEC(duration),
-				   0,
-				   &bufusage,
-				   &walusage,
-				   NULL,
-				   0,
-				   0);
+		SpinLockAcquire(&e->mutex);
+		switch (keys[i].wait_event_info & 0xFF000000)
+		{
+			case PG_WAIT_LOCK:
+				e->counters.wait.lock_time += msec;
+				break;
+			case PG_WAIT_LWLOCK:
+				e->counters.wait.lwlock_time += msec;
+				break;
+			case PG_WAIT_IO:
+				e->counters.wait.io_time += msec;
+				break;
+			case PG_WAIT_IPC:
+				e->counters.wait.ipc_time += msec;
+				break;
+			case PG_WAIT_CLIENT:
+				e->counters.wait.client_time += msec;
+				break;
+		}
+		SpinLockRelease(&e->mutex);
 	}
-	else
-	{
+	LWLockRelease(pgss->lock);
+}
 
-    		if (planner_hook_next)
-        		result = planner_hook_next(parse, query_string, cursorOptions, boundParams);
-    		result = standard_planner(parse, query_string, cursorOptions, boundParams);
-	}
-#else
-    if (planner_hook_next)
-		result = planner_hook_next(parse, opt, param);
-	result = standard_planner(parse, opt, param);
-#endif
-	return result;
+/*
+ * Pick the interval until the next sample.  While backends are running
+ * queries we sample every pgsm_wait_sample_interval; once the server goes
+ * idle the interval doubles on each empty sample, up to
+ * pgsm_wait_sample_max_interval.
+ */
+static int
+next_wait_interval(int interval, int active)
+{
+	int		min_interval = PGSM_WAIT_SAMPLE_INTERVAL;
+	int		max_interval = Max(PGSM_WAIT_SAMPLE_MAX_INTERVAL, min_interval);
+
+	if (active > 0)
+		return min_interval;
+	return Min(Max(interval, min_interval) * 2, max_interval);
 }
 
+/*
+ * Add the samples of keys to the wait profiles.  Existing profiles are
+ * updated under the shared lock; the lock is only taken exclusively when
+ * some (queryid, wait event) pair shows up for the first time.
+ */
 static void
-update_wait_event(void)
+update_wait_profile(pgssWaitProfileKey *keys, int nkeys, uint64 elapsed)
 {
-	PGPROC	*proc = NULL;
-	int 	i;
+	pgssWaitProfileEntry	*entry;
+	int		nmissing = 0;
+	int		i;
 
-	LWLockAcquire(ProcArrayLock, LW_SHARED);
-	for (i = 0; i < ProcGlobal->allProcCount; i++)
-    {
-        proc = &ProcGlobal->allProcs[i];
-		if (proc->pid == 0)
+	LWLockAcquire(pgss->lock, LW_SHARED);
+	for (i = 0; i < nkeys; i++)
+	{
+		entry = (pgssWaitProfileEntry *) hash_search(pgss_waitprofilehash, &keys[i], HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			keys[nmissing++] = keys[i];
 			continue;
+		}
+		pg_atomic_fetch_add_u64(&entry->samples, 1);
+		pg_atomic_fetch_add_u64(&entry->time, elapsed);
+	}
+	LWLockRelease(pgss->lock);
+
+	if (nmissing == 0)
+		return;
 
-		pgssWaitEventEntries[i]->wait_event_info = proc->wait_event_info;
-		pgssWaitEventEntries[i]->pid = proc->pid;
+	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+	for (i = 0; i < nmissing; i++)
+	{
+		bool	found;
+
+		entry = (pgssWaitProfileEntry *) hash_search(pgss_waitprofilehash, &keys[i], HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			break;				/* out of shared memory, drop the samples */
+		if (!found)
+		{
+			pg_atomic_init_u64(&entry->samples, 0);
+			pg_atomic_init_u64(&entry->time, 0);
+		}
+		pg_atomic_fetch_add_u64(&entry->samples, 1);
+		pg_atomic_fetch_add_u64(&entry->time, elapsed);
 	}
-	LWLockRelease(ProcArrayLock);
+	LWLockRelease(pgss->lock);
 }
 
 static void
@@ -2767,44 +5351,115 @@ handle_sigterm(SIGNAL_ARGS)
     sigterm = true;
 }
 
+static void
+handle_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+	errno = save_errno;
+}
+
+/*
+ * Register the collector workers.  Each one samples a stripe of allProcs,
+ * every pgsm_wait_workers-th slot starting from its number in bgw_main_arg.
+ * Slots are handed out from the start of allProcs, so interleaving spreads
+ * the busy ones over all the workers.
+ */
 static void
 register_wait_event(void)
 {
     BackgroundWorker worker;
+	int		n;
 
-    memset(&worker, 0, sizeof(worker));
-    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
-    worker.bgw_start_time = BgWorkerStart_ConsistentState;
-    worker.bgw_restart_time = 0;
-    worker.bgw_notify_pid = 0;
-    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_stat_monitor");
-    snprintf(worker.bgw_function_name, BGW_MAXLEN, CppAsString(wait_event_main));
-    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_stat_monitor collector");
-    worker.bgw_main_arg = (Datum) 0;
-    RegisterBackgroundWorker(&worker);
+	for (n = 0; n < PGSM_WAIT_WORKERS; n++)
+	{
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 0;
+		worker.bgw_notify_pid = 0;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_stat_monitor");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, CppAsString(wait_event_main));
+		if (PGSM_WAIT_WORKERS == 1)
+			snprintf(worker.bgw_name, BGW_MAXLEN, "pg_stat_monitor collector");
+		else
+			snprintf(worker.bgw_name, BGW_MAXLEN, "pg_stat_monitor collector %d", n);
+		worker.bgw_main_arg = Int32GetDatum(n);
+		RegisterBackgroundWorker(&worker);
+	}
 }
 
 void
 wait_event_main(Datum main_arg)
 {
 	int rc;
+	int			worker = DatumGetInt32(main_arg);
+	int			interval = PGSM_WAIT_SAMPLE_INTERVAL;
+	int			nsamples = 0;
+	int			active = 0;
+	pgssWaitSampler	*sampler = &pgss->wait_sampler[worker];
+	TimestampTz	last_sample;
+	TimestampTz	last_rate;
 
 	InitPostgres(NULL, InvalidOid, NULL, InvalidOid, NULL, false);
 	SetProcessingMode(NormalProcessing);
     pqsignal(SIGTERM, handle_sigterm);
+	pqsignal(SIGHUP, handle_sighup);
     BackgroundWorkerUnblockSignals();
+
+	last_sample = last_rate = GetCurrentTimestamp();
 	while (1)
 	{
+		TimestampTz	now;
+		TimestampTz	elapsed;
+
         if (sigterm)
             break;
-		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 1, PG_WAIT_EXTENSION);
+		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   interval, PG_WAIT_EXTENSION);
 
 		if (rc & WL_POSTMASTER_DEATH)
             proc_exit(1);
 
         ResetLatch(&MyProc->procLatch);
 
-		update_wait_event();
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/*
+		 * Charge each sample with the time actually elapsed since the last
+		 * one, so the profile stays right when the worker oversleeps.  After
+		 * an idle sample the backends found now only started somewhere in
+		 * the backed off gap, so they are charged the active interval at
+		 * most.
+		 */
+		now = GetCurrentTimestamp();
+		elapsed = Max(now - last_sample, 0);
+		if (active == 0)
+			elapsed = Min(elapsed, (TimestampTz) PGSM_WAIT_SAMPLE_INTERVAL * 1000);
+		active = update_wait_event((uint64) elapsed, worker, PGSM_WAIT_WORKERS);
+		last_sample = now;
+		nsamples++;
+
+		interval = next_wait_interval(interval, active);
+
+		SpinLockAcquire(&pgss->mutex);
+		sampler->interval = interval;
+		sampler->active = active;
+		sampler->samples++;
+		if (now - last_rate >= USECS_PER_SEC)
+		{
+			sampler->sample_rate = nsamples * (double) USECS_PER_SEC / (now - last_rate);
+			nsamples = 0;
+			last_rate = now;
+		}
+		SpinLockRelease(&pgss->mutex);
 	}
 	proc_exit(0);
 }
@@ -2828,6 +5483,169 @@ get_query_id(pgssJumbleState *jstate, Query *query)
 	return queryid;
 }
 
+/*
+ * Fingerprint the plan of a statement, subplans included.
+ */
+static uint64
+get_plan_id(PlannedStmt *pstmt)
+{
+	pgssJumbleState	jstate;
+	ListCell		*lc;
+	uint64			planid;
+
+	jstate.jumble = (unsigned char *) palloc(JUMBLE_SIZE);
+	jstate.jumble_len = 0;
+	jstate.clocations_buf_size = 0;
+	jstate.clocations = NULL;
+	jstate.clocations_count = 0;
+	jstate.highest_extern_param_id = 0;
+
+	JumblePlan(&jstate, pstmt->planTree, pstmt->rtable);
+	foreach(lc, pstmt->subplans)
+		JumblePlan(&jstate, (Plan *) lfirst(lc), pstmt->rtable);
+
+	planid = DatumGetUInt64(hash_any_extended(jstate.jumble, jstate.jumble_len, 0));
+	pfree(jstate.jumble);
+
+	/* Zero means no plan */
+	return planid != 0 ? planid : 1;
+}
+
+/*
+ * Compact EXPLAIN text of the plan being executed, without costs.
+ */
+static char *
+explain_plan_text(QueryDesc *queryDesc, int *len)
+{
+	ExplainState	*es = NewExplainState();
+
+	es->analyze = false;
+	es->verbose = false;
+	es->buffers = false;
+	es->costs = false;
+	es->timing = false;
+	es->summary = false;
+	es->format = EXPLAIN_FORMAT_TEXT;
+
+	ExplainBeginOutput(es);
+	ExplainPrintPlan(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Remove the trailing newline */
+	if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
+		es->str->data[--es->str->len] = '\0';
+
+	*len = es->str->len;
+	return es->str->data;
+}
+
+/*
+ * Count an execution of queryId with plan planid.  The first time the plan
+ * is seen in the bucket its EXPLAIN text is stored in the query text store,
+ * under PLAN_TEXT_ID(), apart from the query texts.
+ */
+static void
+pgss_store_plan(QueryDesc *queryDesc, uint64 queryId, uint64 planid,
+				double total_time, uint64 rows, double weight)
+{
+	pgssPlanHashKey	key;
+	pgssPlanEntry	*entry;
+	pgssHashKey		stmt_key;
+	pgssEntry		*stmt;
+	char			*plan_text = NULL;
+	int				plan_len = 0;
+	MemoryContext	plan_cxt = NULL;
+	bool			text_found;
+	TimestampTz		now = GetCurrentTimestamp();
+
+	if (!pgss || !pgss_planhash)
+		return;
+
+	memset(&key, 0, sizeof(pgssPlanHashKey));
+	key.bucket_id = pgss->current_wbucket;
+	key.queryid = queryId;
+	key.planid = planid;
+	key.userid = GetUserId();
+	key.dbid = MyDatabaseId;
+
+	LWLockAcquire(pgss->lock, LW_SHARED);
+	entry = (pgssPlanEntry *) hash_search(pgss_planhash, &key, HASH_FIND, NULL);
+	text_found = query_text_ref(key.bucket_id, PGSS_TEXT_PLAN, PLAN_TEXT_ID(queryId, planid));
+	if (!entry || !text_found)
+	{
+		bool	found;
+
+		/* Build the text without holding the lock */
+		LWLockRelease(pgss->lock);
+		if (!text_found)
+		{
+			MemoryContext	oldcxt;
+
+			/* The ExplainState and its buffers go away with the context */
+			plan_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											 "pg_stat_monitor plan text",
+											 ALLOCSET_DEFAULT_SIZES);
+			oldcxt = MemoryContextSwitchTo(plan_cxt);
+			plan_text = explain_plan_text(queryDesc, &plan_len);
+			MemoryContextSwitchTo(oldcxt);
+		}
+		LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+
+		entry = (pgssPlanEntry *) hash_search(pgss_planhash, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			goto exit;
+		if (!found)
+		{
+			memset((char *) entry + sizeof(pgssPlanHashKey), 0,
+				   sizeof(pgssPlanEntry) - sizeof(pgssPlanHashKey));
+			entry->first_seen = now;
+			entry->encoding = GetDatabaseEncoding();
+			SpinLockInit(&entry->mutex);
+		}
+		if (!text_found)
+			store_query(key.bucket_id, PGSS_TEXT_PLAN, PLAN_TEXT_ID(queryId, planid),
+						plan_text, plan_len);
+	}
+
+	{
+		volatile pgssPlanEntry *e = (volatile pgssPlanEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		e->calls += 1;
+		e->est_calls += weight;
+		e->total_time += total_time * weight;
+		e->rows += SAMPLE_SCALE(rows, weight);
+		if (e->calls == 1 || e->min_time > total_time)
+			e->min_time = total_time;
+		if (e->calls == 1 || e->max_time < total_time)
+			e->max_time = total_time;
+		e->last_seen = now;
+		SpinLockRelease(&e->mutex);
+	}
+
+	/* Remember the plan of the last execution of the statement */
+	stmt_key.bucket_id = key.bucket_id;
+	stmt_key.queryid = queryId;
+	stmt_key.userid = key.userid;
+	stmt_key.dbid = key.dbid;
+	stmt = (pgssEntry *) hash_search(pgss_hash, &stmt_key, HASH_FIND, NULL);
+	if (stmt)
+	{
+		volatile pgssEntry *e = (volatile pgssEntry *) stmt;
+
+		SpinLockAcquire(&e->mutex);
+		e->counters.info.planid = planid;
+		SpinLockRelease(&e->mutex);
+	}
+
+exit:
+	LWLockRelease(pgss->lock);
+
+	qtext_flush();
+	if (plan_cxt)
+		MemoryContextDelete(plan_cxt);
+}
+
 Datum
 pg_stat_monitor_settings(PG_FUNCTION_ARGS)
 {
@@ -2861,7 +5679,7 @@ pg_stat_monitor_settings(PG_FUNCTION_ARGS)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	for(i = 0; i < 11; i++)
+	for(i = 0; i < MAX_SETTINGS; i++)
 	{
 		Datum		values[7];
 		bool		nulls[7];
@@ -5,6 +5,7 @@
 
 #include <arpa/inet.h>
 #include <math.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -12,39 +13,76 @@
 
 #include "access/hash.h"
 #include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "common/pg_lzcompress.h"
 #include "executor/instrument.h"
 #include "common/ip.h"
 #include "funcapi.h"
+#include "libpq/libpq-be.h"
+#include "lib/ilist.h"
 #include "access/twophase.h"
+#include "access/xact.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "optimizer/planner.h"
+#include "postmaster/autovacuum.h"
 #include "postmaster/bgworker.h"
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
 #include "parser/scanner.h"
 #include "parser/scansup.h"
 #include "pgstat.h"
+#include "port/atomics.h"
+#include "replication/walsender.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/proc.h"
 #include "storage/spin.h"
 #include "tcop/utility.h"
 #include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/timestamp.h"
 #include "utils/lsyscache.h"
 #include "utils/guc.h"
+#include "utils/inet.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_PGSM_TSC	1
+#endif
 
-#define IsHashInitialize()	(pgss || pgss_hash || pgss_object_hash || pgss_agghash || pgss_buckethash || pgss_waiteventshash)
+#define IsHashInitialize()	(pgss || pgss_hash || pgss_object_hash || pgss_texthash || pgss_agghash || pgss_buckethash || pgssWaitEventEntries || pgss_waitprofilehash || pgss_planhash)
 
-#define MAX_BACKEND_PROCESES (MaxBackends + NUM_AUXILIARY_PROCS + max_prepared_xacts)
+/*
+ * Number of PGPROC slots in ProcGlobal->allProcs.  Computed from the GUCs
+ * rather than MaxBackends, which is still 0 when the shared memory size is
+ * requested.  Walsenders only have their own slots from PG 12 on, so this
+ * is a little more than needed before that.
+ */
+#define MAX_BACKEND_PROCESES \
+	(MaxConnections + autovacuum_max_workers + 1 + max_worker_processes + \
+	 max_wal_senders + NUM_AUXILIARY_PROCS + max_prepared_xacts)
 
 /* Time difference in miliseconds */
 #define	TIMEVAL_DIFF(start, end) (((double) end.tv_sec + (double) end.tv_usec / 1000000.0) \
 	- ((double) start.tv_sec + (double) start.tv_usec / 1000000.0)) * 1000
 
-#define  ArrayGetTextDatum(x) array_get_datum(x)
+
+/* Scale an additive counter of a sampled execution */
+#define SAMPLE_SCALE(x, w)	((int64) rint((double) (x) * (w)))
 
 /* XXX: Should USAGE_EXEC reflect execution time and/or buffer usage? */
 #define USAGE_EXEC(duration)	(1.0)
@@ -61,6 +99,8 @@
 #define MAX_REL_LEN			255
 #define MAX_BUCKETS			10
 #define MAX_OBJECT_CACHE	100
+#define MAX_WAIT_WORKERS	16
+#define MAX_RECENT_PLANS	16
 #define TEXT_LEN			255
 
 typedef struct GucVariables
@@ -96,9 +136,16 @@ typedef enum AGG_KEY
 {
 	AGG_KEY_DATABASE = 0,
 	AGG_KEY_USER,
-	AGG_KEY_HOST
+	AGG_KEY_HOST,
+	AGG_KEY_APPNAME,
+	AGG_KEY_TAG,
+	AGG_KEY_CLIENT_PORT,
+
+	AGG_KEY_COUNT				/* Must be last value of this enum */
 } AGG_KEY;
 
+#define AGG_KEY_ENABLED(type)	((pgsm_agg_dimensions & (1 << (type))) != 0)
+
 /* Bucket shared_memory storage */
 typedef struct pgssBucketHashKey
 {
@@ -131,6 +178,35 @@ typedef struct pgssObjectEntry
 	slock_t				mutex;						/* protects the counters only */
 } pgssObjectEntry;
 
+/*
+ * Statistics aggregated per database, user or host.  They are updated with
+ * atomics, without taking any lock but the shared pgss->lock; times are kept
+ * in microseconds and calls in thousandths, to account for sampling.
+ * Each counter costs an atomic add per execution, except min_time and
+ * max_time which are only written when an execution sets a new extreme.
+ * userdb and host are those of the last statement counted, userdb being
+ * the userid in the high half and the dbid in the low half.
+ */
+#define AGG_CALLS_SCALE		1000
+
+typedef struct pgssAggCounters
+{
+	pg_atomic_uint64	calls;				/* number of quries per database/user/ip */
+	pg_atomic_uint64	rows;				/* total # of retrieved or affected rows */
+	pg_atomic_uint64	total_time;			/* total execution time */
+	pg_atomic_uint64	min_time;			/* minimum execution time */
+	pg_atomic_uint64	max_time;			/* maximum execution time */
+	pg_atomic_uint64	shared_blks_hit;
+	pg_atomic_uint64	shared_blks_read;
+	pg_atomic_uint64	utime;				/* total user cpu time */
+	pg_atomic_uint64	stime;				/* total system cpu time */
+	pg_atomic_uint64	resp_calls[MAX_RESPONSE_BUCKET];	/* execution time's in msec */
+	pg_atomic_uint64	userdb;
+	pg_atomic_uint32	host;
+} pgssAggCounters;
+
+#define AGG_USEC(msec)	((uint64) rint((msec) * 1000.0))
+
 /* Aggregate shared memory storage */
 typedef struct pgssAggHashKey
 {
@@ -140,35 +216,48 @@ typedef struct pgssAggHashKey
 	uint64		bucket_id;		/* bucket_id is the foreign key to pgssBucketHashKey */
 } pgssAggHashKey;
 
-typedef struct pgssAggCounters
-{
-	uint64		total_calls;		/* number of quries per database/user/ip */
-} pgssAggCounters;
-
 typedef struct pgssAggEntry
 {
 	pgssAggHashKey	key;			/* hash key of entry - MUST BE FIRST */
 	pgssAggCounters	counters;		/* the statistics aggregates */
-	slock_t			mutex;			/* protects the counters only */
+	char			label[NAMEDATALEN];	/* application_name, tag or port range */
+	int				heap_slot;		/* position in the dimension's heap */
 } pgssAggEntry;
 
 
-typedef struct pgssWaitEventKey
-{
-	uint64		processid;
-} pgssWaitEventKey;
-
-#define MAX_QUERY_LEN 1024
+/*
+ * Last sampled wait event of a backend, and the query it is running.  These
+ * live in a dense array indexed by the backend's position in allProcs.
+ */
 typedef struct pgssWaitEventEntry
 {
-	pgssAggHashKey	key;			/* hash key of entry - MUST BE FIRST */
 	uint64			queryid;
-	uint64			pid;
+	Oid				userid;			/* user running the query */
+	Oid				dbid;			/* database of the query */
+	int				pid;
 	uint32 			wait_event_info;
-	char			query[MAX_QUERY_LEN];
-	slock_t			mutex;			/* protects the counters only */
 } pgssWaitEventEntry;
 
+/*
+ * Wait profile of a query: how many times the collector sampled a backend
+ * running the query while it was in a given wait event, and the time those
+ * samples stand for.  A wait_event_info of zero means the backend was not
+ * waiting.  Profiles are kept per bucket and expire with it.
+ */
+typedef struct pgssWaitProfileKey
+{
+	uint64		bucket_id;
+	uint64		queryid;
+	uint32		wait_event_info;
+} pgssWaitProfileKey;
+
+typedef struct pgssWaitProfileEntry
+{
+	pgssWaitProfileKey	key;		/* hash key of entry - MUST BE FIRST */
+	pg_atomic_uint64	samples;
+	pg_atomic_uint64	time;		/* in microseconds */
+} pgssWaitProfileEntry;
+
 
 /* shared nenory storage for the query */
 typedef struct pgssHashKey
@@ -185,12 +274,14 @@ typedef struct QueryInfo
 	Oid			userid;						/* user OID */
 	Oid			dbid;						/* database OID */
 	uint		host;						/* client IP */
+	uint64		planid;						/* plan of the last execution */
 	char		tables_name[MAX_REL_LEN];   /* table names involved in the query */
 } QueryInfo;
 
 typedef struct Calls
 {
-	int64		calls;						/* # of times executed */
+	int64		calls;						/* # of recorded executions (samples) */
+	double		est_calls;					/* # of times executed, scaled by sampling */
 	int64		rows;						/* total # of retrieved or affected rows */
 	double		usage;						/* usage factor */
 } Calls;
@@ -226,6 +317,30 @@ typedef struct SysInfo
 	float		stime;						/* system cpu time */
 } SysInfo;
 
+/*
+ * Executions of a statement from a cached plan, by kind of plan, and the
+ * time spent building custom plans.  Counts are scaled by sampling.
+ */
+typedef struct PlanCache
+{
+	double		generic_calls;				/* executions of a reused plan */
+	double		custom_calls;				/* executions of a custom plan */
+	double		replan_time;				/* custom planning time, in msec */
+} PlanCache;
+
+/*
+ * Time spent waiting per wait class, estimated by the collector from the
+ * sampled wait events of the backends running the query.
+ */
+typedef struct WaitTime
+{
+	double		lock_time;					/* heavyweight lock waits, in msec */
+	double		lwlock_time;				/* LWLock waits, in msec */
+	double		io_time;					/* IO waits, in msec */
+	double		ipc_time;					/* IPC waits, in msec */
+	double		client_time;				/* client waits, in msec */
+} WaitTime;
+
 /*
  * The actual stats counters kept within pgssEntry.
  */
@@ -237,10 +352,45 @@ typedef struct Counters
 	CallTime	time[PGSS_NUMKIND];
 	Blocks		blocks;
 	SysInfo		sysinfo;
+	WaitTime	wait;
+	PlanCache	plancache;
+	double		topk_error;		/* weight inherited from an evicted entry */
 } Counters;
 
 /* Some global structure to get the cpu usage, really don't like the idea of global variable */
 
+/*
+ * Statistics per plan of a statement.  The plan is identified by a
+ * fingerprint of the shape of the PlannedStmt tree, and its EXPLAIN text is
+ * kept once in the query text store, keyed by PLAN_TEXT_ID().  Statements
+ * with the same plan shape share a planid, so the key includes the queryid.
+ */
+typedef struct pgssPlanHashKey
+{
+	uint64		bucket_id;		/* bucket number */
+	uint64		queryid;		/* query identifier */
+	uint64		planid;			/* plan identifier */
+	Oid			userid;			/* user OID */
+	Oid			dbid;			/* database OID */
+} pgssPlanHashKey;
+
+#define PLAN_TEXT_ID(queryid, planid)	hash_combine64((queryid), (planid))
+
+typedef struct pgssPlanEntry
+{
+	pgssPlanHashKey	key;			/* hash key of entry - MUST BE FIRST */
+	double			est_calls;		/* # of times executed, scaled by sampling */
+	double			total_time;		/* total execution time, in msec */
+	double			min_time;		/* minimum execution time in msec */
+	double			max_time;		/* maximum execution time in msec */
+	int64			calls;			/* # of recorded executions (samples) */
+	int64			rows;			/* total # of retrieved or affected rows */
+	TimestampTz		first_seen;		/* first execution with this plan */
+	TimestampTz		last_seen;		/* last execution with this plan */
+	int				encoding;		/* plan text encoding */
+	slock_t			mutex;			/* protects the counters only */
+} pgssPlanEntry;
+
 /*
  * Statistics per statement
  */
@@ -249,15 +399,142 @@ typedef struct pgssEntry
 	pgssHashKey		key;			/* hash key of entry - MUST BE FIRST */
 	Counters		counters;		/* the statistics for this query */
 	int				encoding;		/* query text encoding */
+	int				heap_slot;		/* position in the bucket's top-K heap */
 	slock_t			mutex;			/* protects the counters only */
 } pgssEntry;
 
 typedef struct QueryFifo
 {
-		int head;
-		int tail;
+		uint64 head;			/* position where the next text goes */
+		uint64 tail;			/* position of the oldest text */
 } QueryFifo;
 
+/* What a text of the text store is the text of */
+typedef enum pgssTextKind
+{
+	PGSS_TEXT_QUERY = 0,		/* query text, id is the queryid */
+	PGSS_TEXT_PLAN				/* EXPLAIN text, id is PLAN_TEXT_ID() */
+} pgssTextKind;
+
+/*
+ * Query text shared memory storage, one text per queryid (or plan) for all
+ * buckets.  Keys are zeroed before being filled in, so the padding hashes
+ * and compares the same everywhere.
+ */
+typedef struct pgssTextHashKey
+{
+	uint64		id;				/* query identifier, or plan text id */
+	uint32		kind;			/* pgssTextKind */
+} pgssTextHashKey;
+
+typedef struct pgssTextEntry
+{
+	pgssTextHashKey		key;		/* hash key of entry - MUST BE FIRST */
+	uint64				pos;		/* position of the text in pgss_qbuf */
+	uint32				len;		/* bytes stored */
+	uint32				raw_len;	/* length of the query text */
+	bool				spilled;	/* pos is an offset in PGSM_TEXT_FILE */
+	pg_atomic_uint32	refs;		/* bitmap of buckets using the text,
+									 * so MAX_BUCKETS can't exceed 32 */
+} pgssTextEntry;
+
+/*
+ * Mapping of the query file kept by pg_stat_monitor_text() across the rows
+ * of a scan, released with the function's memory context.
+ */
+typedef struct pgssTextMap
+{
+	char					*qfile;			/* mapped query file, or NULL */
+	Size					size;			/* bytes mapped */
+	uint32					generation;		/* pgss->qfile_generation mapped */
+	MemoryContextCallback	cleanup;		/* unmaps the file */
+} pgssTextMap;
+
+/*
+ * Texts that do not fit in pgss_qbuf are appended to this file, which is
+ * compacted as the buckets referencing them expire.
+ */
+#define PGSM_TEXT_FILE	PG_STAT_TMP_DIR "/pg_stat_monitor_query_texts.stat"
+
+/*
+ * Capacity of the text store: a query text per statement, and an EXPLAIN
+ * text per plan, pgss_planhash having room for as many plans as statements.
+ */
+#define PGSM_TEXT_MAX	(PGSM_MAX * 2)
+
+/*
+ * Header of a query text in pgss_qbuf or PGSM_TEXT_FILE.  Texts are stored compressed when
+ * that saves space, in which case len is smaller than raw_len.  A header
+ * with len zero marks the unused end of the buffer.
+ */
+typedef struct pgssQueryHdr
+{
+	pgssTextHashKey	key;		/* text stored after the header */
+	uint32		len;			/* bytes stored after the header */
+	uint32		raw_len;		/* length of the query text */
+} pgssQueryHdr;
+
+/* Texts shorter than this are not worth compressing */
+#define QUERY_COMPRESS_MIN_LEN	64
+
+#ifdef USE_LZ4
+#define QUERY_COMPRESS_BOUND(len)	LZ4_compressBound(len)
+#else
+#define QUERY_COMPRESS_BOUND(len)	PGLZ_MAX_OUTPUT(len)
+#endif
+
+/* Usage of the query text store */
+typedef struct pgssQueryBufStats
+{
+	pg_atomic_uint64	raw_bytes;		/* length of the stored texts */
+	pg_atomic_uint64	stored_bytes;	/* bytes they take after compression */
+	pg_atomic_uint64	evicted;		/* # of texts moved to the query file */
+	pg_atomic_uint64	dropped;		/* # of texts that didn't fit */
+} pgssQueryBufStats;
+
+#define ResetQueryBufStats(x) \
+do { \
+		pg_atomic_init_u64(&(x)->raw_bytes, 0); \
+		pg_atomic_init_u64(&(x)->stored_bytes, 0); \
+		pg_atomic_init_u64(&(x)->evicted, 0); \
+		pg_atomic_init_u64(&(x)->dropped, 0); \
+} while(0)
+
+/*
+ * Min-heap of shared hash entries by weight, to find eviction victims
+ * without scanning the hash table.  The weight of an entry only grows while
+ * it lives, so the heap keeps the weight it had when it was placed and
+ * refreshes it only when the entry reaches the top.  Each entry records its
+ * position in the int at slot_offset.  Changed under exclusive pgss->lock.
+ */
+typedef struct pgssHeapItem
+{
+	void			*entry;				/* entry in a shared hash table */
+	double			weight;				/* its weight when it was placed */
+} pgssHeapItem;
+
+typedef struct pgssHeap
+{
+	int				size;				/* items in use */
+	int				capacity;			/* room in items */
+	int				mode;				/* what the weights measure, -1 if unknown */
+	Size			slot_offset;		/* offset of the position in an entry */
+	pgssHeapItem	*items;
+} pgssHeap;
+
+typedef double (*pgssHeapWeight) (void *entry);
+
+/*
+ * State of one wait event collector, which samples a stripe of allProcs
+ */
+typedef struct pgssWaitSampler
+{
+	int				interval;			/* current sampling interval (ms) */
+	int				active;				/* active backends at the last sample */
+	double			sample_rate;		/* samples per second, last second */
+	uint64			samples;			/* # of samples taken */
+} pgssWaitSampler;
+
 /*
  * Global shared state
  */
@@ -267,29 +544,47 @@ typedef struct pgssSharedState
 	double			cur_median_usage;	/* current median usage in hashtable */
 	slock_t			mutex;				/* protects following fields only: */
 	Size			extent;				/* current extent of query file */
+	Size			spill_garbage;		/* bytes of released texts in query file */
 	int				n_writers;			/* number of active writers to query file */
+	uint32			qfile_generation;	/* bumped whenever query file is rewritten */
 	uint64			current_wbucket;
 	uint64			prev_bucket_usec;
 	uint64			bucket_overflow[MAX_BUCKETS];
 	uint64			bucket_entry[MAX_BUCKETS];
-	QueryFifo		query_fifo[MAX_BUCKETS];
+	uint64			bucket_evicted[MAX_BUCKETS];
+	uint64			agg_entries[AGG_KEY_COUNT];		/* # of aggregates per dimension */
+	uint64			agg_overflow[AGG_KEY_COUNT];	/* # of times a dimension was full */
+	uint64			agg_evicted[AGG_KEY_COUNT];		/* # of aggregates evicted */
+	pgssWaitSampler	wait_sampler[MAX_WAIT_WORKERS];
+	pgssHeap		topk_heap[MAX_BUCKETS];			/* entries of each bucket */
+	pgssHeap		agg_heap[AGG_KEY_COUNT];		/* aggregates of each dimension */
+	QueryFifo		query_fifo;
+	pgssQueryBufStats qbuf_stats;
 } pgssSharedState;
 
 #define ResetSharedState(x) \
 do { \
 		x->cur_median_usage = ASSUMED_MEDIAN_INIT; \
 		x->cur_median_usage = ASSUMED_MEDIAN_INIT; \
+		x->extent = 0; \
+		x->spill_garbage = 0; \
 		x->n_writers = 0; \
+		x->qfile_generation = 0; \
 		x->current_wbucket = 0; \
 		x->prev_bucket_usec = 0; \
 		memset(&x->bucket_overflow, 0, MAX_BUCKETS * sizeof(uint64)); \
 		memset(&x->bucket_entry, 0, MAX_BUCKETS * sizeof(uint64)); \
-		memset(&x->query_fifo, 0, MAX_BUCKETS * sizeof(uint64)); \
+		memset(&x->bucket_evicted, 0, MAX_BUCKETS * sizeof(uint64)); \
+		memset(&x->agg_entries, 0, AGG_KEY_COUNT * sizeof(uint64)); \
+		memset(&x->agg_overflow, 0, AGG_KEY_COUNT * sizeof(uint64)); \
+		memset(&x->agg_evicted, 0, AGG_KEY_COUNT * sizeof(uint64)); \
+		memset(&x->wait_sampler, 0, MAX_WAIT_WORKERS * sizeof(pgssWaitSampler)); \
+		memset(&x->query_fifo, 0, sizeof(QueryFifo)); \
 } while(0)
 
 
 
-unsigned char *pgss_qbuf[MAX_BUCKETS];
+unsigned char *pgss_qbuf;
 
 /*
  * Struct for tracking locations/lengths of constants during normalization
@@ -340,6 +635,84 @@ static const struct config_enum_entry track_options[] =
 	{NULL, 0, false}
 };
 
+typedef enum
+{
+	PGSM_TIMING_FULL,			/* executor instrumentation on totaltime */
+	PGSM_TIMING_FAST			/* statement start/end clock reads only */
+} PGSMTIMINGMODE;
+
+typedef enum
+{
+	PGSM_TOPK_NONE,				/* drop new queries when a bucket is full */
+	PGSM_TOPK_CALLS,			/* keep the most called queries */
+	PGSM_TOPK_TIME				/* keep the queries with most total time */
+} PGSMTOPKMODE;
+
+static const struct config_enum_entry topk_options[] =
+{
+	{"none", PGSM_TOPK_NONE, false},
+	{"calls", PGSM_TOPK_CALLS, false},
+	{"total_time", PGSM_TOPK_TIME, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry timing_options[] =
+{
+	{"full", PGSM_TIMING_FULL, false},
+	{"fast", PGSM_TIMING_FAST, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Kind of plan a statement is executed with.  A plan built right before its
+ * execution with parameter values is custom; a plan executed again without
+ * being planned is a generic plan reused from the plan cache.
+ */
+typedef enum pgssPlanKind
+{
+	PGSM_PLAN_NONE = 0,			/* planned for this execution only */
+	PGSM_PLAN_GENERIC,
+	PGSM_PLAN_CUSTOM
+} pgssPlanKind;
+
+/*
+ * A plan built by this backend and not executed yet.  Plans are matched by
+ * address and queryid, and forgotten when the transaction ends.
+ */
+typedef struct pgssRecentPlan
+{
+	PlannedStmt	*plan;
+	uint64		queryid;			/* queryid of the planned statement */
+	bool		custom;				/* planned with parameter values */
+	double		plan_time;			/* planning time in msec */
+} pgssRecentPlan;
+
+/*
+ * Executor state of a tracked statement.  QueryDesc has no room for
+ * extension data, so states are matched by its address.  A state lives in
+ * the statement's executor memory and is unlinked when that memory goes
+ * away, whether the statement ended or errored out.
+ */
+typedef struct pgssExecState
+{
+	dlist_node	node;				/* link in the list of live statements */
+	MemoryContextCallback cleanup;	/* unlinks the state with es_query_cxt */
+	QueryDesc	*queryDesc;			/* statement the state belongs to */
+	uint64		start_ticks;		/* clock reading at ExecutorStart */
+	bool		fast;				/* timed by clock reads, not totaltime */
+	double		sample_weight;		/* 100 / sample rate, 0 if not sampled */
+	bool		timed;				/* statement is timed, not just published */
+	uint64		planid;				/* plan fingerprint, 0 if not tracked */
+	pgssPlanKind plan_kind;			/* generic or custom cached plan */
+	double		replan_time;		/* time spent building a custom plan */
+	uint64		prev_queryid;		/* queryid published before this one */
+	struct rusage rusage_start;		/* resource usage at ExecutorStart */
+	BufferUsage	bufusage_start;		/* pgBufferUsage at ExecutorStart */
+#if PG_VERSION_NUM >= 130000
+	WalUsage	walusage_start;		/* pgWalUsage at ExecutorStart */
+#endif
+} pgssExecState;
+
 #define PGSS_ENABLED() \
 	(PGSM_TRACK == PGSM_TRACK_ALL || \
 	(PGSM_TRACK == PGSM_TRACK_TOP && nested_level == 0))
@@ -360,6 +733,24 @@ void init_guc(void);
 #define PGSM_RESPOSE_TIME_LOWER_BOUND conf[9].guc_variable
 #define PGSM_RESPOSE_TIME_STEP conf[10].guc_variable
 #define PGSM_TRACK_PLANNING conf[11].guc_variable
-
-GucVariable conf[12];
+#define PGSM_TIMING conf[12].guc_variable
+#define PGSM_SAMPLE_RATE conf[13].guc_variable
+#define PGSM_SAMPLE_SLOW_THRESHOLD conf[14].guc_variable
+#define PGSM_TOPK conf[15].guc_variable
+#define PGSM_AGG_MAX(type) conf[16 + (type)].guc_variable
+#define PGSM_WAIT_SAMPLE_INTERVAL conf[22].guc_variable
+#define PGSM_WAIT_SAMPLE_MAX_INTERVAL conf[23].guc_variable
+#define PGSM_WAIT_WORKERS conf[24].guc_variable
+#define PGSM_TRACK_PLANS conf[25].guc_variable
+#define PGSM_AGG_PORT_RANGE conf[26].guc_variable
+
+#define MAX_SETTINGS 27
+
+GucVariable conf[MAX_SETTINGS];
+
+/* List GUCs, kept out of conf[] as they are not integers */
+extern char *pgsm_agg_dimensions_string;
+extern int pgsm_agg_dimensions;
+extern char *pgsm_tag;
+extern const char *agg_dimension_names[AGG_KEY_COUNT];
 #endif
@@ -0,0 +1,101 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsm_planner_counter.c
+ *		Planner hook for the regression tests, checking that pg_stat_monitor
+ *		chains to the hooks installed before it and plans each statement
+ *		once.  Must come before pg_stat_monitor in shared_preload_libraries.
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_stat_monitor/pgsm_planner_counter.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "executor/executor.h"
+#include "fmgr.h"
+#include "optimizer/planner.h"
+
+PG_MODULE_MAGIC;
+
+void _PG_init(void);
+void _PG_fini(void);
+
+PG_FUNCTION_INFO_V1(pgsm_planner_calls);
+PG_FUNCTION_INFO_V1(pgsm_unplanned_execs);
+
+static planner_hook_type prev_planner_hook = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+
+/* Calls of the hook, and executions of plans it did not return */
+static int64 planner_calls = 0;
+static int64 unplanned_execs = 0;
+static PlannedStmt *last_plan = NULL;
+
+#if PG_VERSION_NUM >= 130000
+static PlannedStmt *
+counter_planner_hook(Query *parse, const char *query_string, int cursorOptions,
+					 ParamListInfo boundParams)
+#else
+static PlannedStmt *
+counter_planner_hook(Query *parse, int cursorOptions, ParamListInfo boundParams)
+#endif
+{
+	planner_calls++;
+#if PG_VERSION_NUM >= 130000
+	if (prev_planner_hook)
+		last_plan = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+	else
+		last_plan = standard_planner(parse, query_string, cursorOptions, boundParams);
+#else
+	if (prev_planner_hook)
+		last_plan = prev_planner_hook(parse, cursorOptions, boundParams);
+	else
+		last_plan = standard_planner(parse, cursorOptions, boundParams);
+#endif
+	return last_plan;
+}
+
+/*
+ * A hook above this one that plans the statement again executes a plan
+ * this hook never saw.
+ */
+static void
+counter_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (queryDesc->plannedstmt != last_plan)
+		unplanned_execs++;
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+}
+
+void
+_PG_init(void)
+{
+	prev_planner_hook = planner_hook;
+	planner_hook = counter_planner_hook;
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = counter_ExecutorStart;
+}
+
+void
+_PG_fini(void)
+{
+	planner_hook = prev_planner_hook;
+	ExecutorStart_hook = prev_ExecutorStart;
+}
+
+Datum
+pgsm_planner_calls(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(planner_calls);
+}
+
+Datum
+pgsm_unplanned_execs(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(unplanned_execs);
+}
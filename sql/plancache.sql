@@ -0,0 +1,22 @@
+CREATE EXTENSION pg_stat_monitor;
+CREATE TABLE plancache_t (a int);
+SELECT pg_stat_monitor_reset();
+PREPARE plancache_p(int) AS SELECT count(*) FROM plancache_t WHERE a = $1;
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+EXECUTE plancache_p(1);
+
+-- The first executions are planned for their parameter, the later ones
+-- reuse the generic plan from the plan cache
+SELECT custom_plan_calls, generic_plan_calls > 0 AS generic,
+       replan_time > 0 AS replanned
+  FROM pg_stat_monitor WHERE query LIKE '%plancache_t WHERE a = $1';
+
+DEALLOCATE plancache_p;
+DROP TABLE plancache_t;
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,24 @@
+CREATE EXTENSION pg_stat_monitor;
+CREATE FUNCTION planner_calls() RETURNS int8
+  AS 'pgsm_planner_counter', 'pgsm_planner_calls' LANGUAGE C;
+CREATE FUNCTION unplanned_execs() RETURNS int8
+  AS 'pgsm_planner_counter', 'pgsm_unplanned_execs' LANGUAGE C;
+
+-- pg_stat_monitor calls the planner hook loaded before it, and executes
+-- the plan it returned: once for SELECT 1, once for the check itself
+SELECT planner_calls() AS calls, unplanned_execs() AS unplanned \gset
+SELECT 1 AS one;
+SELECT planner_calls() - :calls AS planned,
+       unplanned_execs() - :unplanned AS replanned;
+
+-- Same when the planning is tracked
+SET pg_stat_monitor.pgsm_track_planning = on;
+SELECT planner_calls() AS calls, unplanned_execs() AS unplanned \gset
+SELECT 1 AS one;
+SELECT planner_calls() - :calls AS planned,
+       unplanned_execs() - :unplanned AS replanned;
+RESET pg_stat_monitor.pgsm_track_planning;
+
+DROP FUNCTION planner_calls();
+DROP FUNCTION unplanned_execs();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,20 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_track_plans = on;
+CREATE TABLE plan_t (a int, b int);
+SELECT pg_stat_monitor_reset();
+SELECT * FROM plan_t WHERE a = 1;
+SELECT * FROM plan_t WHERE b = 1;
+
+-- Both statements scan plan_t, so they share a planid
+SELECT count(*) AS statements, count(DISTINCT planid) AS planids,
+       bool_and(planid <> 0) AS tracked
+  FROM pg_stat_monitor WHERE query LIKE 'SELECT * FROM plan_t%';
+
+-- but each one keeps the EXPLAIN text of its own plan
+SELECT regexp_replace(p.query_plan, '\s+', ' ', 'g') AS plan
+  FROM pg_stat_monitor_plans p JOIN pg_stat_monitor m USING (bucket, queryid, planid)
+ WHERE m.query LIKE 'SELECT * FROM plan_t%'
+ ORDER BY plan;
+
+DROP TABLE plan_t;
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,31 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.track = 'all';
+SET pg_stat_monitor.pgsm_topk = 'calls';
+SELECT pg_stat_monitor_reset();
+
+-- Distinct statements with long, poorly compressible texts wrap the query
+-- buffer several times; texts still in use move to the query file.
+DO $$
+DECLARE
+	i int;
+BEGIN
+	FOR i IN 1..10000 LOOP
+		EXECUTE format('SELECT 1 AS %I, 2 AS %I, 3 AS %I, 4 AS %I, 5 AS %I',
+					   'a' || md5(i::text), 'b' || md5((i + 1)::text),
+					   'c' || md5((i + 2)::text), 'd' || md5((i + 3)::text),
+					   'e' || md5((i + 4)::text));
+	END LOOP;
+END
+$$;
+
+SELECT spilled_texts > 0 AS spilled, evicted > 0 AS evicted, used <= size AS bounded
+  FROM pg_stat_monitor_query_buffer;
+
+-- Texts read back from the buffer and from the file are intact
+SELECT count(*) > 0 AS found,
+       bool_and(query ~ '^SELECT \$1 AS a[0-9a-f]{32}, \$2 AS b[0-9a-f]{32}, \$3 AS c[0-9a-f]{32}, \$4 AS d[0-9a-f]{32}, \$5 AS e[0-9a-f]{32}$') AS intact
+  FROM pg_stat_monitor
+ WHERE query LIKE 'SELECT $1 AS a%';
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,30 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.track = 'all';
+SET pg_stat_monitor.pgsm_topk = 'calls';
+SELECT pg_stat_monitor_reset();
+
+SELECT dropped AS dropped_before FROM pg_stat_monitor_query_buffer \gset
+-- More distinct statements than pgsm_max, around one heavy hitter
+DO $$
+DECLARE
+	i int;
+BEGIN
+	FOR i IN 1..6000 LOOP
+		EXECUTE 'SELECT 42 AS heavy';
+		EXECUTE format('SELECT 1 AS %I', 'churn_' || md5(i::text));
+	END LOOP;
+END
+$$;
+
+-- The heavy hitter is kept, with its text
+SELECT DISTINCT query FROM pg_stat_monitor WHERE query LIKE '%AS heavy';
+
+-- Evicted statements gave their texts back: none was dropped for lack of
+-- room, and the query file holds little more than the live texts
+SELECT dropped = :dropped_before AS not_dropped,
+       texts <= current_setting('pg_stat_monitor.pgsm_max')::int AS texts_bounded,
+       file_size <= 2 * (stored_bytes + 32 * texts) + 8192 AS file_bounded
+  FROM pg_stat_monitor_query_buffer;
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,22 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT pg_sleep(.5);
+
+-- The collector sampled the sleep while it was running
+SELECT count(*) > 0 AS sampled
+  FROM pg_stat_wait_profile w JOIN pg_stat_monitor m USING (bucket, queryid)
+ WHERE m.query = 'SELECT pg_sleep($1)' AND w.wait_event IS NOT NULL;
+
+SELECT queryid AS sleep_queryid FROM pg_stat_monitor
+ WHERE query = 'SELECT pg_sleep($1)' \gset
+
+-- The shares of the sampled time of each query add up
+SELECT bool_and(abs(total - 100) < 0.1) AS shares
+  FROM (SELECT sum(percent) AS total
+          FROM pg_stat_wait_profile
+         GROUP BY bucket, queryid) p;
+
+-- A reset forgets the profiles
+SELECT pg_stat_monitor_reset();
+SELECT count(*) FROM pg_stat_wait_profile WHERE queryid = :sleep_queryid;
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,12 @@
+CREATE EXTENSION pg_stat_monitor;
+
+-- One row per collector, with its interval between the configured bounds
+SELECT count(*) = current_setting('pg_stat_monitor.pgsm_wait_workers')::int AS workers,
+       bool_and(sample_interval BETWEEN 1 AND 100) AS bounded
+  FROM pg_stat_wait_sampler;
+
+-- The collectors keep sampling
+SELECT sum(samples) AS samples_before FROM pg_stat_wait_sampler \gset
+SELECT pg_sleep(.5);
+SELECT sum(samples) > :samples_before AS sampling FROM pg_stat_wait_sampler;
+DROP EXTENSION pg_stat_monitor;
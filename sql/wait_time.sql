@@ -0,0 +1,27 @@
+CREATE EXTENSION pg_stat_monitor;
+CREATE TABLE wait_time_t (a int);
+SELECT pg_stat_monitor_reset();
+
+-- Samples are charged to existing entries only
+SELECT count(*) FROM wait_time_t;
+
+-- Another session holds a lock on the table for a second
+\! psql -X -q -d contrib_regression -c 'BEGIN; LOCK TABLE wait_time_t; SELECT pg_sleep(1); COMMIT;' > /dev/null 2>&1 &
+DO $$
+BEGIN
+	WHILE NOT EXISTS (SELECT 1 FROM pg_locks
+					   WHERE relation = 'wait_time_t'::regclass AND granted
+						 AND mode = 'AccessExclusiveLock') LOOP
+		PERFORM pg_sleep(0.01);
+	END LOOP;
+END
+$$;
+
+-- Blocks until the other session commits
+SELECT count(*) FROM wait_time_t;
+
+SELECT lock_wait_time > 0 AS lock_waited
+  FROM pg_stat_monitor WHERE query = 'SELECT count(*) FROM wait_time_t';
+
+DROP TABLE wait_time_t;
+DROP EXTENSION pg_stat_monitor;